@@ -3,8 +3,27 @@
 @date: December 6, 2021
 */
 
+// for mkdtemp
+#define _DEFAULT_SOURCE
+
 #include "util.h"
 #include "headify.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
 
 const int DEBUG = false;
 
@@ -14,46 +33,172 @@ static const char* ElementTypeName[] = {
     "eos", "ElementTypeCount"
 };
 
-// Generate the ElementList type and its associated functions. See util.h.
-generate_list(ElementList, Element, elements_, );
-
 /*
-Creates a new dynamically allocated element of the given type extending from
-begin (inclusive) to end (exclusive).
+Returns a new element on the stack of the given type extending from begin
+(inclusive) to end (exclusive).
 */
-Element* new_element(ElementType type, char* begin, char* end) {
-#if 0
-    static char* first_begin = NULL;
-    if (first_begin == NULL) first_begin = begin;
-    int n = end - begin;
-    char out[n + 1];
-    memcpy(out, begin, n);
-    out[n] = '\0';
-    printf("new_element: %s, %lu, %lu %s\n", ElementTypeName[type], 
-            begin - first_begin, end - first_begin,  type == tok ? out : "");
-#endif
+Element make_element(ElementType type, char* begin, char* end) {
     require("valid type", 0 <= type && type < ElementTypeCount);
     require_not_null(begin);
     require_not_null(end);
     require("end not before begin", begin <= end);
-    Element* e = xmalloc(sizeof(Element));
-    e->type = type;
-    e->begin = begin;
-    e->end = end;
-    e->next = NULL;
-    return e;
+    return (Element){type, begin, end};
 }
 
 /*
-Returns a new element on the stack of the given type extending from begin
-(inclusive) to end (exclusive).
+Returns the keyword of the token that starts at s and has the given length, or
+kw_none if it is not a keyword. Dispatches on the length and the first
+character, so that most tokens are rejected without comparing characters.
 */
-Element make_element(ElementType type, char* begin, char* end) {
-    require("valid type", 0 <= type && type < ElementTypeCount);
-    require_not_null(begin);
-    require_not_null(end);
-    require("end not before begin", begin <= end);
-    return (Element){type, begin, end, NULL};
+Keyword keyword(char* s, size_t length) {
+    require_not_null(s);
+    switch (length) {
+        case 4:
+            if (s[0] == 'e' && memcmp(s, "enum", 4) == 0) return kw_enum;
+            if (s[0] == 'm' && memcmp(s, "main", 4) == 0) return kw_main;
+            break;
+        case 5:
+            if (s[0] == 'u' && memcmp(s, "union", 5) == 0) return kw_union;
+            break;
+        case 6:
+            switch (s[0]) {
+                case 's':
+                    if (memcmp(s, "struct", 6) == 0) return kw_struct;
+                    if (memcmp(s, "static", 6) == 0) return kw_static;
+                    break;
+                case 'e': if (memcmp(s, "extern", 6) == 0) return kw_extern; break;
+                case 'i': if (memcmp(s, "inline", 6) == 0) return kw_inline; break;
+            }
+            break;
+        case 7:
+            if (s[0] == 't' && memcmp(s, "typedef", 7) == 0) return kw_typedef;
+            break;
+    }
+    return kw_none;
+}
+
+void keyword_test(void) {
+    char* keywords[] = {
+        "", "struct", "union", "enum", "typedef", "static", "extern", "inline", "main"
+    };
+    for (int k = kw_struct; k < KeywordCount; k++) {
+        test_equal_i(keyword(keywords[k], strlen(keywords[k])), k);
+    }
+    test_equal_i(keyword("", 0), kw_none);
+    test_equal_i(keyword("x", 1), kw_none);
+    test_equal_i(keyword("Struct", 6), kw_none);
+    test_equal_i(keyword("enu", 3), kw_none);
+    // words that extend a keyword are not keywords
+    test_equal_i(keyword("mains", 5), kw_none);
+    test_equal_i(keyword("structs", 7), kw_none);
+    test_equal_i(keyword("externs", 7), kw_none);
+    test_equal_i(keyword("inlined", 7), kw_none);
+    test_equal_i(keyword("typedef_", 8), kw_none);
+    // only the given number of chars is considered, the rest of the text is not
+    test_equal_i(keyword("extern x", 6), kw_extern);
+    test_equal_i(keyword("inline(", 6), kw_inline);
+}
+
+/*
+Makes room for at least n more elements in the table. The columns of the table
+are allocated from the arena and are released together with it.
+*/
+void reserve_elements(Arena* arena, ElementTable* table, ptrdiff_t n) {
+    require_not_null(arena);
+    require_not_null(table);
+    require("not negative", n >= 0);
+    ptrdiff_t count = table->count;
+    if (count + n > table->cap) {
+        // grow the columns, the old ones are released with the arena
+        ptrdiff_t cap = table->cap < 1024 ? 1024 : 2 * table->cap;
+        while (cap < count + n) cap *= 2;
+        unsigned char* types = arena_alloc(arena, cap * sizeof(unsigned char));
+        size_t* begins = arena_alloc(arena, cap * sizeof(size_t));
+        size_t* lengths = arena_alloc(arena, cap * sizeof(size_t));
+        unsigned char* keywords = arena_alloc(arena, cap * sizeof(unsigned char));
+        if (count > 0) {
+            memcpy(types, table->types, count * sizeof(unsigned char));
+            memcpy(begins, table->begins, count * sizeof(size_t));
+            memcpy(lengths, table->lengths, count * sizeof(size_t));
+            memcpy(keywords, table->keywords, count * sizeof(unsigned char));
+        }
+        table->types = types;
+        table->begins = begins;
+        table->lengths = lengths;
+        table->keywords = keywords;
+        table->cap = cap;
+    }
+}
+
+/*
+Appends the element to the table. The columns of the table are allocated from
+the arena and are released together with it.
+*/
+void append_element(Arena* arena, ElementTable* table, Element e) {
+    require_not_null(arena);
+    require_not_null(table);
+    require("element in source", table->source <= e.begin);
+    if (table->count >= table->cap) reserve_elements(arena, table, 1);
+    ptrdiff_t n = table->count;
+    table->types[n] = e.type;
+    table->begins[n] = e.begin - table->source;
+    table->lengths[n] = e.end - e.begin;
+    table->keywords[n] = e.type == tok ? keyword(e.begin, e.end - e.begin) : kw_none;
+    table->count = n + 1;
+}
+
+/*
+Appends elements first, first + 1, ... of the other table to the table. Both
+tables have to refer to the same source text.
+*/
+void append_elements(Arena* arena, ElementTable* table, ElementTable* other, ptrdiff_t first) {
+    require_not_null(arena);
+    require_not_null(table);
+    require_not_null(other);
+    require("same source", table->source == other->source);
+    require("valid index", 0 <= first && first <= other->count);
+    ptrdiff_t k = other->count - first;
+    reserve_elements(arena, table, k);
+    ptrdiff_t n = table->count;
+    memcpy(table->types + n, other->types + first, k * sizeof(unsigned char));
+    memcpy(table->begins + n, other->begins + first, k * sizeof(size_t));
+    memcpy(table->lengths + n, other->lengths + first, k * sizeof(size_t));
+    memcpy(table->keywords + n, other->keywords + first, k * sizeof(unsigned char));
+    table->count = n + k;
+}
+
+/*
+Returns the type of element i; or eos if i is beyond the last element.
+*/
+ElementType element_type(ElementTable* table, ptrdiff_t i) {
+    require("valid index", 0 <= i);
+    if (i >= table->count) return eos;
+    return table->types[i];
+}
+
+/*
+Returns the beginning (inclusive) of element i.
+*/
+char* element_begin(ElementTable* table, ptrdiff_t i) {
+    require("valid index", 0 <= i && i < table->count);
+    return table->source + table->begins[i];
+}
+
+/*
+Returns the end (exclusive) of element i.
+*/
+char* element_end(ElementTable* table, ptrdiff_t i) {
+    require("valid index", 0 <= i && i < table->count);
+    return table->source + table->begins[i] + table->lengths[i];
+}
+
+/*
+Returns element i of the table.
+*/
+Element element_at(ElementTable* table, ptrdiff_t i) {
+    require("valid index", 0 <= i && i < table->count);
+    char* begin = table->source + table->begins[i];
+    return (Element){table->types[i], begin, begin + table->lengths[i]};
 }
 
 /*
@@ -61,16 +206,19 @@ Prints the type and contents of the element, followed by a line break.
 */
 void print_element(Element* e) {
     require_not_null(e);
-    printf("%s: %.*s\n", ElementTypeName[e->type], (int)(e->end - e->begin), e->begin);
+    printf("%s: ", ElementTypeName[e->type]);
+    print_string(make_string2(e->begin, e->end - e->begin));
+    printf("\n");
 }
 
 /*
-Prints the elements of the list.
+Prints the elements of the table.
 */
-void print_elements(ElementList* list) {
-    require_not_null(list);
-    for (Element* e = list->first; e != NULL; e = e->next) {
-        print_element(e);
+void print_elements(ElementTable* table) {
+    require_not_null(table);
+    for (ptrdiff_t i = 0; i < table->count; i++) {
+        Element e = element_at(table, i);
+        print_element(&e);
     }
 }
 
@@ -85,166 +233,511 @@ bool braces_match(char bo, char bc) {
 }
 
 /*
-Counts the number of line breaks between s (inclusive) and t (exclusive).
+Finds the line breaks of the source text. Uses strchr, which the C library
+implements with vectorized instructions. The table is allocated from the
+arena.
 */
-int count_line_breaks(char* s, char* t) {
-    require_not_null(s);
-    require_not_null(t);
-    int n = 0;
-    for (; s < t; s++) {
-        if (*s == '\n') n++;
+LineTable get_lines(Arena* arena, char* source_code) {
+    require_not_null(arena);
+    require_not_null(source_code);
+    LineTable lines = {0, 0, NULL};
+    for (char* p = strchr(source_code, '\n'); p != NULL; p = strchr(p + 1, '\n')) {
+        ptrdiff_t n = lines.count;
+        if (n >= lines.cap) {
+            // grow the array, the old one is released with the arena
+            ptrdiff_t cap = lines.cap < 1024 ? 1024 : 2 * lines.cap;
+            size_t* breaks = arena_alloc(arena, cap * sizeof(size_t));
+            if (n > 0) memcpy(breaks, lines.breaks, n * sizeof(size_t));
+            lines.breaks = breaks;
+            lines.cap = cap;
+        }
+        lines.breaks[n] = p - source_code;
+        lines.count = n + 1;
+    }
+    return lines;
+}
+
+/*
+Returns the number of line breaks before the given offset. Uses binary search.
+*/
+ptrdiff_t count_breaks_before(LineTable* lines, size_t offset) {
+    require_not_null(lines);
+    ptrdiff_t lo = 0, hi = lines->count;
+    while (lo < hi) {
+        ptrdiff_t mid = lo + (hi - lo) / 2;
+        if (lines->breaks[mid] < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+Returns the line number (starting at 1) of the given offset.
+*/
+ptrdiff_t line_of(LineTable* lines, size_t offset) {
+    return count_breaks_before(lines, offset) + 1;
+}
+
+/*
+Counts the number of line breaks between offsets s (inclusive) and t
+(exclusive).
+*/
+ptrdiff_t count_line_breaks(LineTable* lines, size_t s, size_t t) {
+    require("t not before s", s <= t);
+    return count_breaks_before(lines, t) - count_breaks_before(lines, s);
+}
+
+void line_table_test(void) {
+    Arena arena = make_arena(1024);
+    char* s = "a\nbc\n\nd";
+    LineTable lines = get_lines(&arena, s);
+    test_equal_i(lines.count, 3);
+    test_equal_i(line_of(&lines, 0), 1);
+    test_equal_i(line_of(&lines, 1), 1);
+    test_equal_i(line_of(&lines, 2), 2);
+    test_equal_i(line_of(&lines, 5), 3);
+    test_equal_i(line_of(&lines, 6), 4);
+    test_equal_i(count_line_breaks(&lines, 0, 7), 3);
+    test_equal_i(count_line_breaks(&lines, 2, 4), 0);
+    test_equal_i(count_line_breaks(&lines, 2, 5), 1);
+    lines = get_lines(&arena, "");
+    test_equal_i(lines.count, 0);
+    test_equal_i(line_of(&lines, 0), 1);
+    arena_free(&arena);
+}
+
+/*
+The characters at which braces, literals, comments, and lines begin or end.
+Inside a group, skip_group only stops at them, all other characters only form
+tokens or whitespace.
+*/
+static const char GroupCharacters[] = "(){}[]\"'/\n";
+
+// Lookup table of the group characters, for the scalar classification.
+static const bool is_group_char[256] = {
+    ['('] = true, [')'] = true, ['{'] = true, ['}'] = true, ['['] = true, [']'] = true, 
+    ['"'] = true, ['\''] = true, ['/'] = true, ['\n'] = true
+};
+
+/*
+Returns the bitmap of the group characters of the n <= 64 characters of the
+block, one character at a time. Bit i is set iff block[i] is a group
+character.
+*/
+uint64_t group_chars_scalar(char* block, size_t n) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (is_group_char[(unsigned char)block[i]]) bits |= (uint64_t)1 << i;
+    }
+    return bits;
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+Returns the bitmap of the group characters of the 64 characters of the block,
+16 characters at a time.
+*/
+__attribute__((target("sse2")))
+uint64_t group_chars_sse2(char* block) {
+    __m128i d[sizeof(GroupCharacters) - 1];
+    for (int k = 0; k < sizeof(GroupCharacters) - 1; k++) {
+        d[k] = _mm_set1_epi8(GroupCharacters[k]);
+    }
+    uint64_t bits = 0;
+    for (int j = 0; j < 64; j += 16) {
+        __m128i x = _mm_loadu_si128((__m128i*)(block + j));
+        __m128i m = _mm_cmpeq_epi8(x, d[0]);
+        for (int k = 1; k < sizeof(GroupCharacters) - 1; k++) {
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(x, d[k]));
+        }
+        bits |= (uint64_t)(uint16_t)_mm_movemask_epi8(m) << j;
+    }
+    return bits;
+}
+
+/*
+Returns the bitmap of the group characters of the 64 characters of the block,
+32 characters at a time. Classifies the characters by looking up their low and
+high nibbles in two tables: a character is a group character iff the entries
+for its nibbles have a bit in common.
+*/
+__attribute__((target("avx2")))
+uint64_t group_chars_avx2(char* block) {
+    // bit 0: 0x0_, bit 1: 0x2_, bit 2: 0x5_ and 0x7_
+    const __m256i lo_table = _mm256_setr_epi8(
+        0, 0, 0x02, 0, 0, 0, 0, 0x02, 0x02, 0x02, 0x01, 0x04, 0, 0x04, 0, 0x02,
+        0, 0, 0x02, 0, 0, 0, 0, 0x02, 0x02, 0x02, 0x01, 0x04, 0, 0x04, 0, 0x02);
+    const __m256i hi_table = _mm256_setr_epi8(
+        0x01, 0, 0x02, 0, 0, 0x04, 0, 0x04, 0, 0, 0, 0, 0, 0, 0, 0,
+        0x01, 0, 0x02, 0, 0, 0x04, 0, 0x04, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t bits = 0;
+    for (int j = 0; j < 64; j += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i*)(block + j));
+        __m256i lo = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(x, nibble));
+        __m256i hi = _mm256_shuffle_epi8(hi_table, 
+                _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble));
+        __m256i m = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), zero);
+        bits |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(m) << j;
+    }
+    return bits;
+}
+#endif
+
+/*
+Returns the bitmap of the group characters of the block, which ends at the end
+of the source text or after 64 characters. Uses AVX2 or SSE2 if the CPU
+supports it and the block is complete.
+*/
+uint64_t group_chars(char* block, char* end) {
+    if (end - block < 64) return group_chars_scalar(block, end - block);
+#ifdef HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) return group_chars_avx2(block);
+    if (__builtin_cpu_supports("sse2")) return group_chars_sse2(block);
+#endif
+    return group_chars_scalar(block, 64);
+}
+
+/*
+Returns a new scanner that starts in the indentation region of the first line.
+*/
+Scanner make_scanner(void) {
+    return (Scanner){true, NULL, NULL, NULL, 0, NULL, 0, NULL};
+}
+
+/*
+Returns a new scanner for the given source text. The scanner knows the bounds
+of the source text, so that it can skip the contents of groups 64 characters
+at a time.
+*/
+Scanner make_block_scanner(char* source) {
+    require_not_null(source);
+    return (Scanner){true, NULL, NULL, source, strlen(source), NULL, 0, NULL};
+}
+
+/*
+Returns the first group character at or after t, or the terminating '\0' if
+there is none. If the scanner knows the bounds of the source text, whole
+blocks of 64 characters are classified at once, and runs of other characters
+are skipped a block at a time. The blocks are aligned to the beginning of the
+source text, the scanner keeps the bitmap of the last one.
+*/
+static char* find_group_char(Scanner* scanner, char* t) {
+    if (scanner->source == NULL) return t + strcspn(t, GroupCharacters);
+    char* end = scanner->source + scanner->length;
+    while (t < end) {
+        size_t i = t - scanner->source;
+        char* block = scanner->source + (i & ~(size_t)63);
+        if (block != scanner->block) {
+            scanner->block = block;
+            scanner->group_chars = group_chars(block, end);
+        }
+        uint64_t bits = scanner->group_chars & (~(uint64_t)0 << (i & 63));
+        if (bits != 0) return block + __builtin_ctzll(bits);
+        t = block + 64;
+    }
+    return end;
+}
+
+/*
+Returns the end of the run of blanks and line continuations that starts at t.
+*/
+char* skip_blanks(char* t) {
+    while (*t == ' ' || *t == '\t' || (*t == '\\' && *(t + 1) == '\n')) {
+        t += *t == '\\' ? 2 : 1;
+    }
+    return t;
+}
+
+/*
+Returns the closing quote of the string or character literal whose contents
+begin at t, or the terminating '\0' if the literal is unterminated. A backslash
+escapes the next character.
+*/
+char* find_literal_end(char* t, char quote) {
+    char set[3] = {quote, '\\', '\0'};
+    while (true) {
+        t += strcspn(t, set);
+        if (*t != '\\') return t;
+        t++; // skip backslash
+        if (*t == '\0') return t;
+        t++; // skip escaped character
+    }
+}
+
+/*
+Returns the star of the star and slash that end the block comment whose
+contents begin at t, or the terminating '\0' if the comment is unterminated.
+*/
+char* find_comment_end(char* t) {
+    char* u = t;
+    while (true) {
+        u += strcspn(u, "/");
+        if (*u == '\0') return u;
+        if (u - 1 >= t && *(u - 1) == '*') return u - 1;
+        u++;
     }
-    return n;
 }
 
-// Is the scanner in the indentation region at the beginning of a line?
-static bool indent = true;
+/*
+Returns the line break that ends the preprocessor directive whose text
+continues at t, which is not preceded by a backslash, or the terminating '\0'.
+The character before t belongs to the directive.
+*/
+char* find_directive_end(char* t) {
+    while (true) {
+        t += strcspn(t, "\n");
+        if (*t == '\0' || *(t - 1) != '\\') return t;
+        t++;
+    }
+}
 
-// Contains the error message in case of an error.
-static char* error_message = NULL;
+/*
+Finds the closing brace that matches the opening brace at s and returns the
+group from s up to and including the closing brace as a single element. The
+emitters copy groups verbatim, so instead of scanning every element of the
+group, only braces, literals, comments, and preprocessor lines are tracked,
+jumping from one relevant character to the next. Braces are matched with an
+explicit stack. Returns an err element in the same cases and with the same
+error messages as scanning the contents element by element.
 
-// Contains the error position in case of an error.
-static char* error_pos = NULL;
+If the scanner has a group state, the scan records checkpoints in it and
+resumes from the last checkpoint when it is called again for the same group,
+e.g., after the text of an incomplete group has been extended. The owner of
+the group state invalidates it when it moves on to another element.
+*/
+Element skip_group(Scanner* scanner, char* s) {
+    require_not_null(scanner);
+    require_not_null(s);
+    // Explicit stack of the offsets of the unmatched opening braces. Typical
+    // nesting depths fit into the local array, deeper nesting moves the stack
+    // to the heap. A resumable scan keeps the stack in the group state.
+    GroupState* g = scanner->group;
+    ptrdiff_t local[64];
+    ptrdiff_t* open = local;
+    int cap = sizeof(local) / sizeof(local[0]);
+    if (g != NULL) {
+        if (g->cap == 0) {
+            g->cap = cap;
+            g->open = xmalloc(g->cap * sizeof(ptrdiff_t));
+        }
+        open = g->open;
+        cap = g->cap;
+    }
+    int n = 0;
+    char* t = s + 1;
+    bool indent = false; // indent state inside the group
+    char* floor = t; // end of the last brace, literal, comment, or directive
+    if (g != NULL && g->valid) {
+        // At most two braces have been pushed or popped after the
+        // checkpoint, which can only have overwritten its top entry.
+        n = g->count;
+        open[n - 1] = g->top;
+        t = s + g->pos;
+        floor = s + g->floor;
+        indent = g->indent;
+    } else {
+        open[n++] = 0;
+    }
+    Element result;
+    while (true) {
+        if (g != NULL && t[0] != '\0' && t[1] != '\0') {
+            // everything before t has been scanned without looking beyond t + 1
+            *g = (GroupState){true, open, n, cap, open[n - 1], t - s, floor - s, indent};
+        }
+        // Skip characters that only form tokens, which end the indentation
+        // region. Outside the indentation region, whitespace, '*', and '#'
+        // do not matter either. Inside the indentation region, they only
+        // matter at t itself.
+        char* p;
+        if (!indent) {
+            p = find_group_char(scanner, t);
+        } else if (scanner->source == NULL) {
+            p = t + strcspn(t, "(){}[]\"'/\n \t#*");
+        } else if (*t == ' ' || *t == '\t' || *t == '#' || *t == '*') {
+            p = t;
+        } else {
+            p = find_group_char(scanner, t);
+        }
+        if (p > t) {
+            t = p;
+            indent = false;
+        }
+        char c = *t;
+        char* u = t + 1;
+        if (c == '\0') {
+            scanner->error_message = "unterminated braces";
+            scanner->error_pos = s + open[n - 1];
+            result = make_element(err, s + open[n - 1], t);
+            break;
+        } else if (c == '(' || c == '{' || c == '[') {
+            if (n >= cap) {
+                if (g != NULL) {
+                    g->cap *= 2;
+                    g->open = xrealloc(g->open, g->cap * sizeof(ptrdiff_t));
+                    open = g->open;
+                } else {
+                    ptrdiff_t* a = xmalloc(2 * cap * sizeof(ptrdiff_t));
+                    memcpy(a, open, n * sizeof(ptrdiff_t));
+                    if (open != local) free(open);
+                    open = a;
+                }
+                cap *= 2;
+            }
+            open[n++] = t - s;
+            indent = false;
+        } else if (c == ')' || c == '}' || c == ']') {
+            char* o = s + open[--n];
+            if (!braces_match(*o, c)) {
+                scanner->error_message = "braces do not match";
+                scanner->error_pos = t;
+                result = make_element(err, o, u);
+                break;
+            }
+            if (n == 0) {
+                if (*s == '(') result = make_element(par, s, u);
+                else if (*s == '{') result = make_element(cur, s, u);
+                else /* '[' */ result = make_element(bra, s, u);
+                break;
+            }
+            indent = false;
+        } else if (c == '"' || c == '\'') {
+            // string or character literal, backslash escapes the next char
+            u = find_literal_end(u, c);
+            if (*u == '\0') {
+                scanner->error_message = c == '"' ? 
+                    "unterminated string literal" : "unterminated character literal";
+                scanner->error_pos = t;
+                result = make_element(err, t, u);
+                break;
+            }
+            u++;
+            indent = false;
+        } else if (c == '/' && *u == '/') {
+            // line comment, ends before the line break
+            u += strcspn(u, "\n");
+            indent = false;
+        } else if (c == '/' && *u == '*') {
+            // block comment, indent state does not change
+            u = find_comment_end(u + 1);
+            if (*u == '\0') {
+                scanner->error_message = "unterminated block comment";
+                scanner->error_pos = t;
+                result = make_element(err, t, u);
+                break;
+            }
+            u += 2;
+        } else if (c == '\n') {
+            // A line break ends the indentation region, unless it is a line
+            // continuation in whitespace. Outside the indentation region,
+            // whitespace has not been scanned, so look back whether the
+            // backslash continues a whitespace run.
+            char* q = t - 1;
+            if (q >= floor && *q == '\\') {
+                while (q - 2 >= floor && *(q - 1) == '\n' && *(q - 2) == '\\') q -= 2;
+                indent = !(q - 1 >= floor && (*(q - 1) == ' ' || *(q - 1) == '\t'));
+            } else {
+                indent = true;
+            }
+        } else if (c == ' ' || c == '\t') {
+            // whitespace, including line continuations, indent state does not
+            // change
+            u = skip_blanks(u);
+        } else if (c == '#' && indent) {
+            // preprocessor directive, ends before the line break that is not
+            // preceded by a backslash
+            u = find_directive_end(u);
+            indent = false;
+        } else if (c == '*') {
+            // indent state does not change for '*'
+        } else {
+            // '/' or '#' as a token
+            indent = false;
+        }
+        if (c != '\n') floor = u;
+        t = u;
+    }
+    if (open != local && g == NULL) free(open);
+    return result;
+}
 
 /*
-Gets the next element from the source text.
+Gets the next element from the source text. The scanner holds the state that
+is carried from one element to the next and receives the error message and
+position in case of an error.
 */
-Element scan_next(char* s) {
+Element scan_next(Scanner* scanner, char* s) {
+    require_not_null(scanner);
     require_not_null(s);
     char* t = s + 1;
     char c = *s;
     char d = *t;
-    bool escape = false;
     switch (c) {
     case '\0': return make_element(eos, s, s);
-    case '\n': indent = true; return make_element(lbr, s, t);
-    case '*': return make_element(indent ? pub : tok, s, t);
-    case ';': indent = false; return make_element(sem, s, t);
-    case '=': indent = false; return make_element(asg, s, t);
+    case '\n': scanner->indent = true; return make_element(lbr, s, t);
+    case '*': return make_element(scanner->indent ? pub : tok, s, t);
+    case ';': scanner->indent = false; return make_element(sem, s, t);
+    case '=': scanner->indent = false; return make_element(asg, s, t);
     case '#': 
-        if (!indent) return make_element(tok, s, t);
-        indent = false;
-        while (*t != '\0') {
-            if (*t == '\\' && *(t + 1) == '\n') {
-                t += 2;
-                continue;
-            }
-            if (*t == '\n') {
-                break;
-            }
-            t++;
-        }
+        if (!scanner->indent) return make_element(tok, s, t);
+        scanner->indent = false;
+        t = find_directive_end(t);
         return make_element(pre, s, t);
     case ' ': case '\t': 
         // indent state does not change for whitespace
-        while (*t != '\0') {
-            if (*t == '\\' && *(t + 1) == '\n') {
-                t += 2;
-                continue;
-            }
-            if (*t != ' ' && *t != '\t') {
-                break;
-            }
-            t++;
-        }
+        t = skip_blanks(t);
         return make_element(whi, s, t);
     case '"': 
-        indent = false;
-        escape = false;
-        while (*t != '\0') {
-            if (!escape && *t == '"') {
-                // treat string literals as tokens
-                return make_element(tok, s, t + 1);
-            }
-            if (*t == '\\') {
-                escape = !escape;
-            } else {
-                escape = false;
-            }
-            t++;
+        scanner->indent = false;
+        t = find_literal_end(t, '"');
+        if (*t == '"') {
+            // treat string literals as tokens
+            return make_element(tok, s, t + 1);
         }
-        error_message = "unterminated string literal";
-        error_pos = s;
+        scanner->error_message = "unterminated string literal";
+        scanner->error_pos = s;
         return make_element(err, s, t);
     case '\'': 
-        indent = false;
-        escape = false;
-        while (*t != '\0') {
-            if (!escape && *t == '\'') {
-                // treat character literals as tokens
-                return make_element(tok, s, t + 1);
-            }
-            if (*t == '\\') {
-                escape = !escape;
-            } else {
-                escape = false;
-            }
-            t++;
+        scanner->indent = false;
+        t = find_literal_end(t, '\'');
+        if (*t == '\'') {
+            // treat character literals as tokens
+            return make_element(tok, s, t + 1);
         }
-        error_message = "unterminated character literal";
-        error_pos = s;
+        scanner->error_message = "unterminated character literal";
+        scanner->error_pos = s;
         return make_element(err, s, t);
     case '/':
         if (d == '/') {
-            indent = false;
-            t++;
-            while (*t != '\0') {
-                /* no nulti-line // comments
-                if (*t == '\\' && *(t + 1) == '\n') {
-                    t += 2;
-                    continue;
-                }
-                */
-                if (*t == '\n') {
-                    break;
-                }
-                t++;
-            }
+            // no multi-line // comments
+            scanner->indent = false;
+            t += 1 + strcspn(t + 1, "\n");
             return make_element(lco, s, t);
         } else if (d == '*') {
             // indent state does not change for block comment
-            t++;
-            while (*t != '\0') {
-                if (*t == '*' && *(t + 1) == '/') {
-                    return make_element(bco, s, t + 2);
-                }
-                t++;
-            }
-            error_message = "unterminated block comment";
-            error_pos = s;
+            t = find_comment_end(t + 1);
+            if (*t != '\0') return make_element(bco, s, t + 2);
+            scanner->error_message = "unterminated block comment";
+            scanner->error_pos = s;
             return make_element(err, s, t);
         } else {
-            indent = false; 
+            scanner->indent = false; 
             return make_element(tok, s, t);
         }
     case '(': case '{': case '[':
-        indent = false;
-        while (*t != '\0') {
-            Element e = scan_next(t);
-            t = e.end;
-            if (e.type == eos) break;
-            if (e.type == err) return e;
-            if (e.type == clo) {
-                if (braces_match(c, *e.begin)) {
-                    if (c == '(') return make_element(par, s, t);
-                    if (c == '{') return make_element(cur, s, t);
-                    /* else '[' */ return make_element(bra, s, t);
-                } else {
-                    error_message = "braces do not match";
-                    error_pos = e.begin;
-                    return make_element(err, s, t);
-                }
-            }
-        }
-        error_message = "unterminated braces";
-        error_pos = s;
-        return make_element(err, s, t);
+        // the closing brace sets the indent state to false
+        scanner->indent = false;
+        return skip_group(scanner, s);
     case ')': case '}': case ']':
-        indent = false;
+        scanner->indent = false;
         return make_element(clo, s, t);
     default:
         assert("not eos, at least one char in token", c != '\0');
-        indent = false;
+        scanner->indent = false;
         while (*t != '\0') {
             switch (*t) {
                 case ' ': case '\t': case '\n': 
@@ -281,443 +774,748 @@ bool base_test_equal_element(const char* file, int line, Element e, ElementType
 Test scan_next.
 */
 void scan_next_test(void) {
+    Scanner scanner = make_scanner();
     Element e;
     
-    e = scan_next("");
+    e = scan_next(&scanner, "");
     test_equal_element(e, eos, "", "");
     
-    e = scan_next("\nabc");
+    e = scan_next(&scanner, "\nabc");
     test_equal_element(e, lbr, "\n", "abc");
     
-    indent = true;
-    e = scan_next("*abc");
+    scanner.indent = true;
+    e = scan_next(&scanner, "*abc");
     test_equal_element(e, pub, "*", "abc");
     
-    indent = false;
-    e = scan_next("*abc");
+    scanner.indent = false;
+    e = scan_next(&scanner, "*abc");
     test_equal_element(e, tok, "*", "abc");
     
-    e = scan_next("abc*");
+    e = scan_next(&scanner, "abc*");
     test_equal_element(e, tok, "abc*", "");
     
-    e = scan_next(";abc");
+    e = scan_next(&scanner, ";abc");
     test_equal_element(e, sem, ";", "abc");
 
-    e = scan_next("=abc");
+    e = scan_next(&scanner, "=abc");
     test_equal_element(e, asg, "=", "abc");
 
-    indent = true;
-    e = scan_next("#abc");
+    scanner.indent = true;
+    e = scan_next(&scanner, "#abc");
     test_equal_element(e, pre, "#abc", "");
 
-    indent = false;
-    e = scan_next("#abc");
+    scanner.indent = false;
+    e = scan_next(&scanner, "#abc");
     test_equal_element(e, tok, "#", "abc");
 
-    indent = true;
-    e = scan_next("#a\nb");
+    scanner.indent = true;
+    e = scan_next(&scanner, "#a\nb");
     test_equal_element(e, pre, "#a", "\nb");
 
-    indent = true;
-    e = scan_next("#a\\\nb\nc"); // line continuation
+    scanner.indent = true;
+    e = scan_next(&scanner, "#a\\\nb\nc"); // line continuation
     test_equal_element(e, pre, "#a\\\nb", "\nc");
 
-    indent = false;
-    e = scan_next("#a\nb");
+    scanner.indent = false;
+    e = scan_next(&scanner, "#a\nb");
     test_equal_element(e, tok, "#", "a\nb");
     
-    e = scan_next(" \t abc def");
+    e = scan_next(&scanner, " \t abc def");
     test_equal_element(e, whi, " \t ", "abc def");
     
-    e = scan_next("\"\"x");
+    e = scan_next(&scanner, "\"\"x");
     test_equal_element(e, tok, "\"\"", "x");
     
-    e = scan_next("\"a\"x");
+    e = scan_next(&scanner, "\"a\"x");
     test_equal_element(e, tok, "\"a\"", "x");
     
-    e = scan_next("\"\\\\\"x");
+    e = scan_next(&scanner, "\"\\\\\"x");
     test_equal_element(e, tok, "\"\\\\\"", "x");
     
-    e = scan_next("''x");
+    e = scan_next(&scanner, "''x");
     test_equal_element(e, tok, "''", "x");
     
-    e = scan_next("'a'x");
+    e = scan_next(&scanner, "'a'x");
     test_equal_element(e, tok, "'a'", "x");
     
-    e = scan_next("'\\\\'x");
+    e = scan_next(&scanner, "'\\\\'x");
     test_equal_element(e, tok, "'\\\\'", "x");
 
-    e = scan_next("//x");
+    e = scan_next(&scanner, "//x");
     test_equal_element(e, lco, "//x", "");
     
-    e = scan_next("//x\na");
+    e = scan_next(&scanner, "//x\na");
     test_equal_element(e, lco, "//x", "\na");
     
-    e = scan_next("/**/x");
+    e = scan_next(&scanner, "/**/x");
     test_equal_element(e, bco, "/**/", "x");
     
-    e = scan_next("/*abc*/x");
+    e = scan_next(&scanner, "/*abc*/x");
     test_equal_element(e, bco, "/*abc*/", "x");
     
-    e = scan_next("abc def");
+    e = scan_next(&scanner, "abc def");
     test_equal_element(e, tok, "abc", " def");
     
-    e = scan_next("(abc)x");
+    e = scan_next(&scanner, "(abc)x");
     test_equal_element(e, par, "(abc)", "x");
 
-    e = scan_next("(x[abc]y)z");
+    e = scan_next(&scanner, "(x[abc]y)z");
     test_equal_element(e, par, "(x[abc]y)", "z");
 
-    e = scan_next("{x[a{ b }c]y}z");
+    e = scan_next(&scanner, "{x[a{ b }c]y}z");
     test_equal_element(e, cur, "{x[a{ b }c]y}", "z");
 
-    e = scan_next("[x[a{ b }c]y]z");
+    e = scan_next(&scanner, "[x[a{ b }c]y]z");
     test_equal_element(e, bra, "[x[a{ b }c]y]", "z");
 
-    e = scan_next("([abc)x");
+    e = scan_next(&scanner, "([abc)x");
     test_equal_element(e, err, "[abc)", "x");
-    printf("error = %s\n", error_message);
+    printf("error = %s\n", scanner.error_message);
+
+    // an opening brace ends the indentation region
+    e = scan_next(&scanner, "{\n( \\\n#)}x");
+    test_equal_element(e, cur, "{\n( \\\n#)}", "x");
+
+    e = scan_next(&scanner, "{\n  #x }\n}x");
+    test_equal_element(e, cur, "{\n  #x }\n}", "x");
+
+    e = scan_next(&scanner, "{\"}\\\"}\" '}' /* } */ // }\n}x");
+    test_equal_element(e, cur, "{\"}\\\"}\" '}' /* } */ // }\n}", "x");
+
+    e = scan_next(&scanner, "(a{b[c]d}x");
+    test_equal_element(e, err, "(a{b[c]d}x", "");
+    test_equal_i(scanner.error_pos[0], '(');
+    printf("error = %s\n", scanner.error_message);
+
+    // nesting deeper than the local bracket stack
+    int depth = 1000;
+    char deep[2 * depth + 2];
+    for (int i = 0; i < depth; i++) {
+        deep[i] = "({["[i % 3];
+        deep[2 * depth - 1 - i] = ")}]"[i % 3];
+    }
+    deep[2 * depth] = 'x';
+    deep[2 * depth + 1] = '\0';
+    e = scan_next(&scanner, deep);
+    test_equal_i(e.type, par);
+    test_equal_i(e.end - e.begin, 2 * depth);
 
-    e = scan_next(")abc");
+    e = scan_next(&scanner, ")abc");
     test_equal_element(e, clo, ")", "abc");
 
-    e = scan_next("}abc");
+    e = scan_next(&scanner, "}abc");
     test_equal_element(e, clo, "}", "abc");
 
-    e = scan_next("]abc");
+    e = scan_next(&scanner, "]abc");
     test_equal_element(e, clo, "]", "abc");
 
-    e = scan_next("/*abc");
+    e = scan_next(&scanner, "/*abc");
     test_equal_element(e, err, "/*abc", "");
-    printf("error = %s\n", error_message);
+    printf("error = %s\n", scanner.error_message);
 
-    e = scan_next("\"abc");
+    e = scan_next(&scanner, "\"abc");
     test_equal_element(e, err, "\"abc", "");
-    printf("error = %s\n", error_message);
+    printf("error = %s\n", scanner.error_message);
 
-    e = scan_next("'abc");
+    e = scan_next(&scanner, "'abc");
     test_equal_element(e, err, "'abc", "");
-    printf("error = %s\n", error_message);
+    printf("error = %s\n", scanner.error_message);
 
-    e = scan_next("abc def");
+    e = scan_next(&scanner, "abc def");
     test_equal_element(e, tok, "abc", " def");
 
-    e = scan_next("abc\tdef");
+    e = scan_next(&scanner, "abc\tdef");
     test_equal_element(e, tok, "abc", "\tdef");
 
-    e = scan_next("abc\ndef");
+    e = scan_next(&scanner, "abc\ndef");
     test_equal_element(e, tok, "abc", "\ndef");
 
-    e = scan_next("abc(def");
+    e = scan_next(&scanner, "abc(def");
     test_equal_element(e, tok, "abc", "(def");
 
-    e = scan_next("abc{def");
+    e = scan_next(&scanner, "abc{def");
     test_equal_element(e, tok, "abc", "{def");
 
-    e = scan_next("abc[def");
+    e = scan_next(&scanner, "abc[def");
     test_equal_element(e, tok, "abc", "[def");
 
-    e = scan_next("abc;def");
+    e = scan_next(&scanner, "abc;def");
     test_equal_element(e, tok, "abc", ";def");
 
-    e = scan_next("abc=def");
+    e = scan_next(&scanner, "abc=def");
     test_equal_element(e, tok, "abc", "=def");
 
-    e = scan_next("abc/def");
+    e = scan_next(&scanner, "abc/def");
     test_equal_element(e, tok, "abc", "/def");
 
-    e = scan_next("/def");
+    e = scan_next(&scanner, "/def");
     test_equal_element(e, tok, "/", "def");
 
-    indent = true;
 }
 
 /*
-Parses the source text into a list of elements.
+Checks that the scanner that skips groups a block at a time produces the same
+elements as the scanner that does not know the bounds of the source text.
 */
-ElementList get_elements(char* filename, char* source_code) {
-    require_not_null(filename);
-    require_not_null(source_code);
-    ElementList elements = {NULL, NULL};
-    Element e = scan_next(source_code);
-    while (e.type != eos) {
-        if (e.type == err) {
-            int line = count_line_breaks(source_code, error_pos) + 1;
-            fprintf(stderr, "%s:%d: %s\n", filename, line, error_message);
-            exit(EXIT_FAILURE);
-        }
-        elements_append(&elements, new_element(e.type, e.begin, e.end));
-        e = scan_next(e.end);
+bool base_test_block_scan(char* file, int line, char* s) {
+    Scanner plain = make_scanner();
+    Scanner block = make_block_scanner(s);
+    Element e = scan_next(&plain, s);
+    Element f = scan_next(&block, s);
+    bool ok = true;
+    while (ok && e.type != eos && e.type != err) {
+        ok = e.type == f.type && e.begin == f.begin && e.end == f.end;
+        e = scan_next(&plain, e.end);
+        f = scan_next(&block, f.end);
     }
-    return elements;
+    ok = ok && e.type == f.type && e.begin == f.begin && e.end == f.end;
+    return base_test_equal_i(file, line, ok, true);
 }
 
-// Checks if e is an assignment.
-bool is_asg(Element* e) {
-    return e != NULL && e->type == asg;
-}
+#define test_block_scan(s) base_test_block_scan(__FILE__, __LINE__, s)
+
+void block_scan_test(void) {
+    test_block_scan("");
+    test_block_scan("abc");
+    test_block_scan("abc def\tghi\njkl;mno=pqr/stu\\vwx\"y\"'z'");
+    test_block_scan("*int f(int i){return 2*i;}\n#define X 1\n/* c */ // d\n");
+    test_block_scan("a_token_that_is_longer_than_sixty_four_characters_0123456789_0123456789;x");
+    test_block_scan("int a[] = {1, 2, 3}; typedef struct Point {double x; double y;} Point;");
+    // literals, comments, and directives inside and outside of groups
+    test_block_scan("s = \"a\\\"(\\\\\"; c = '\\''; d = '\"'; /* ( / * */ // ) \\\n x");
+    test_block_scan("f() {\n  s = \"}\\\"{\"; c = '}';\n  /* } */ x = a / b * c; // }\n"
+            "#define X }\\\n    {\n  *p = 1; \\\n \t# y\n  x = \\\n \\\n# z\n}\n");
+    test_block_scan("#if 1 \\\n (\n \t \\\n  \\\n\t/**/ x");
+    test_block_scan("f() {\n /* */ *x; /* unterminated");
+    test_block_scan("f() {\n \"unterminated\\");
+    // groups that are longer than a block, and that end in a partial block
+    test_block_scan("{ a_run_of_token_characters_that_is_longer_than_a_block_of_64_chars } x");
+    test_block_scan("int f() {\n  return a_run_of_token_characters_longer_than_a_block; \n}");
+    test_block_scan("int f() {\n  return a_run_of_token_characters_longer_than_a_block; \n");
+    // all delimiters and some other characters at every position of a word
+    char s[400];
+    const char* chars = " \t\n;=/\\\"'({[)}]*#ab_0";
+    int n = strlen(chars);
+    for (int i = 0; i < sizeof(s) - 1; i++) {
+        s[i] = (i % 7 == 0 || i % 11 == 0) ? chars[(i * 13) % n] : 'a' + i % 26;
+    }
+    s[sizeof(s) - 1] = '\0';
+    test_block_scan(s);
 
-// Checks if e is a curly braces element {...}.
-bool is_curly(Element* e) {
-    return e != NULL && e->type == cur;
+#ifdef HAVE_X86_SIMD
+    // the vectorized classifications agree with the scalar one
+    for (int i = 0; i + 64 <= sizeof(s) - 1; i += 64) {
+        uint64_t scalar = group_chars_scalar(s + i, 64);
+        test_equal_i(group_chars_sse2(s + i) == scalar, true);
+        if (__builtin_cpu_supports("avx2")) {
+            test_equal_i(group_chars_avx2(s + i) == scalar, true);
+        }
+    }
+#endif
 }
 
-// Is the element a struct or union or enum token?
-bool is_struct_union_enum(Element* e) {
-    if (e == NULL || e->type != tok) return false;
-    String s = make_string2(e->begin, e->end - e->begin);
-    return cstring_equal(s, "struct") 
-        || cstring_equal(s, "union") 
-        || cstring_equal(s, "enum");
+/*
+Prints the error the scanner ran into.
+*/
+void report_scan_error(char* filename, ElementTable* elements, Scanner* scanner) {
+    ptrdiff_t line = line_of(&elements->lines, scanner->error_pos - elements->source);
+    fprintf(stderr, "%s:%td: %s\n", filename, line, scanner->error_message);
 }
 
-// Is the element a typedef token?
-bool is_typedef(Element* e) {
-    if (e == NULL || e->type != tok) return false;
-    String s = make_string2(e->begin, e->end - e->begin);
-    return cstring_equal(s, "typedef");
+/*
+Scans the source text from offset p to its end and appends the elements to the
+table. Returns false if the source text is malformed. The scanner then holds
+the position and the message of the error.
+*/
+bool try_scan_rest(Arena* arena, ElementTable* elements, Scanner* scanner, size_t p) {
+    Element e = scan_next(scanner, elements->source + p);
+    while (e.type != eos) {
+        if (e.type == err) return false;
+        append_element(arena, elements, e);
+        e = scan_next(scanner, e.end);
+    }
+    return true;
 }
 
 /*
-Returns the next element that is neither whi nor lbr; or NULL if there is no
-such element.
+Scans the source text from offset p to its end and appends the elements to the
+table. Reports the error and returns false if the source text is malformed.
 */
-Element* skip_whi_lbr(Element* e) {
-    for (; e != NULL; e = e->next) {
-        if (e->type != whi && e->type != lbr) {
-            return e;
-        }
+bool scan_rest(Arena* arena, char* filename, ElementTable* elements, Scanner* scanner, size_t p) {
+    if (!try_scan_rest(arena, elements, scanner, p)) {
+        report_scan_error(filename, elements, scanner);
+        return false;
     }
-    return NULL;
+    return true;
 }
 
 /*
-Returns the next element that is neither whi nor lbr nor sem; or NULL if there
-is no such element.
+Minimum number of bytes per thread of a parallel scan. Smaller source texts are
+scanned on a single thread.
 */
-Element* skip_whi_lbr_sem(Element* e) {
-    for (; e != NULL; e = e->next) {
-        if (e->type != whi && e->type != lbr && e->type != sem) {
-            return e;
+#define SCAN_CHUNK_MIN (4 << 20)
+
+/*
+Scans the elements of a chunk, starting at its beginning and stopping at the
+first element that begins at or after the end of the chunk, or at an error.
+The chunk is scanned in a copy of its text, so the scan never reads beyond the
+end of the chunk, even if the chunk begins within a literal, a comment, or a
+group. An element that reaches the end of the copy may continue in the next
+chunk, so the scan stops before it unless it is a line break or the chunk is
+the last one. The stitched scan continues from there.
+*/
+void* scan_chunk(void* arg) {
+    ScanChunk* c = arg;
+    char* source = c->elements.source;
+    size_t length = c->end - c->start;
+    bool last = source[c->end] == '\0';
+    char* copy = xmalloc(length + 1);
+    memcpy(copy, source + c->start, length);
+    copy[length] = '\0';
+    c->scanner = make_block_scanner(copy);
+    c->elements.source = copy;
+    char* p = copy;
+    char* end = copy + length;
+    while (p < end) {
+        bool indent = c->scanner.indent;
+        Element e = scan_next(&c->scanner, p);
+        if (e.type == eos) break;
+        if (e.type == err || (e.end == end && e.type != lbr && !last)) {
+            // restore the state before the element, an error is reported
+            // when the stitched scan reaches it
+            c->scanner.indent = indent;
+            c->failed = e.type == err;
+            break;
         }
+        append_element(&c->arena, &c->elements, e);
+        p = e.end;
     }
+    c->exit = c->start + (p - copy);
+    // refer to the elements in the source text rather than in the copy
+    for (ptrdiff_t i = 0; i < c->elements.count; i++) {
+        c->elements.begins[i] += c->start;
+    }
+    c->elements.source = source;
+    c->scanner = (Scanner){c->scanner.indent, NULL, NULL, NULL, 0, NULL, 0, NULL};
+    free(copy);
     return NULL;
 }
 
-static const char* PhraseTypeNames[] = {
-    "unknown", "error", "fun_dec", "fun_def", "var_dec", "var_def", "arr_dec", "arr_def", 
-    "struct_union_enum_def", "type_def", "preproc", "line_comment", "block_comment"
-};
-
 /*
-Prints the phrase in the format [*PhraseType:<phrase contents>] followed by a
-line break. The '*' indicates a public phrase.
+Returns i if the speculative scan of the chunk was in the given state (offset p
+and indent state) before its element i, or -1 if it never was. The result is
+the number of elements if the state is the one at the exit of the chunk. From
+a common state on, the sequential scan and the speculative scan produce the
+same elements.
 */
-void print_phrase(Phrase* phrase) {
-    require_not_null(phrase);
-    printf("[%s%s:", phrase->is_public ? "*" : "", PhraseTypeNames[phrase->type]);
-    Element* e = phrase->first;
-    Element* f = phrase->last;
-    if (e != NULL && f != NULL) {
-        char* p = e->begin;
-        char* q = f->end;
-        print_string(make_string2(p, q - p));
+ptrdiff_t sync_index(ScanChunk* c, size_t p, bool indent) {
+    require_not_null(c);
+    if (p == c->exit && indent == c->scanner.indent && !c->failed) {
+        return c->elements.count;
     }
-    printf("]\n");
+    if (!indent || p < c->start || p >= c->exit) return -1;
+    if (p == c->start) return 0;
+    // The state after a line break is in the indentation region, so an
+    // element that follows a line break agrees in both states.
+    ptrdiff_t lo = 0, hi = c->elements.count;
+    while (lo < hi) {
+        ptrdiff_t mid = lo + (hi - lo) / 2;
+        if (c->elements.begins[mid] < p) lo = mid + 1; else hi = mid;
+    }
+    if (lo > 0 && lo < c->elements.count && c->elements.begins[lo] == p 
+            && c->elements.types[lo - 1] == lbr) {
+        return lo;
+    }
+    return -1;
 }
 
 /*
-Goes to next non-whitespace and non-linebreak element. Sets input to NULL if no
-such element exists.
+Parses the source text into a table of elements, using the given number of
+threads. The source text is split into chunks at line breaks. Each chunk is
+scanned speculatively, assuming that it starts in the indentation region of a
+line, outside of groups, literals, and comments. This is the state at the
+beginning of most lines. The chunks are then stitched together in order. If
+the actual state at the beginning of a chunk differs, e.g., because the chunk
+starts within a function body or a block comment, the chunk is scanned
+sequentially until the actual state agrees with the speculative one. The
+speculative scan of a chunk never reads beyond its end. The resulting table is
+the same as that of a sequential scan. The table is allocated from the arena.
+Reports the error and returns false if the source text is malformed.
 */
-State* next(State* s) {
-    require_not_null(s);
-    Element* e = s->input;
-    require("valid input", e == NULL || (e->type != whi && e->type != lbr));
-    if (e == NULL) return s;
-    e = e->next;
-    e = skip_whi_lbr(e);
-    s->input = e;
-    ensure("valid input", e == NULL || (e->type != whi && e->type != lbr));
-    return s;
-}
+bool try_get_elements_parallel(Arena* arena, char* filename, char* source_code, int threads,
+        ElementTable* result) {
+    require_not_null(arena);
+    require_not_null(filename);
+    require_not_null(source_code);
+    require("positive", threads > 0);
+    require_not_null(result);
+    ElementTable elements = {source_code, 0, 0, NULL, NULL, NULL, NULL};
+    elements.lines = get_lines(arena, source_code);
+    Scanner scanner = make_block_scanner(source_code);
+    if (threads == 1) {
+        bool ok = scan_rest(arena, filename, &elements, &scanner, 0);
+        *result = elements;
+        return ok;
+    }
 
-/*
-Returns the current input symbol; or eos if the end of the input has been
-reached.
-*/
-ElementType symbol(State* s) {
-    require_not_null(s);
-    Element* e = s->input;
-    if (e == NULL) return eos;
-    return e->type;
-}
+    // split into chunks that begin at the beginning of a line
+    size_t length = scanner.length;
+    ScanChunk* chunks = xcalloc(threads, sizeof(ScanChunk));
+    size_t start = 0;
+    for (int k = 0; k < threads; k++) {
+        size_t end = length;
+        if (k < threads - 1) {
+            size_t split = length / threads * (k + 1);
+            if (split < start) split = start;
+            char* q = memchr(source_code + split, '\n', length - split);
+            if (q != NULL) end = q + 1 - source_code;
+        }
+        ScanChunk* c = chunks + k;
+        c->arena = make_arena(64 * 1024);
+        c->elements = (ElementTable){source_code, 0, 0, NULL, NULL, NULL, NULL};
+        c->start = start;
+        c->end = end;
+        start = end;
+    }
 
-/*
-The following functions, named f_..., detect a Phrase from sequence of Elements.
-The functions implement a simple recusive descent parser.
-*/
+    // scan the first chunk on this thread and the others in parallel
+    pthread_t* ids = xcalloc(threads, sizeof(pthread_t));
+    for (int k = 1; k < threads; k++) {
+        int r = pthread_create(ids + k, NULL, scan_chunk, chunks + k);
+        panicf_if(r != 0, "cannot create scanner thread (%d)", r);
+    }
+    scan_chunk(chunks);
+    for (int k = 1; k < threads; k++) {
+        pthread_join(ids[k], NULL);
+    }
+    free(ids);
 
-void f_start(State* state) {
-    switch (symbol(state)) {
-        case tok: {
-                Element* e = state->input;
-                if (is_struct_union_enum(e)) {
-                    f_struct_union_enum(next(state));
-                } else if (is_typedef(e)) {
-                    f_typedef(next(state));
-                } else {
-                    f_tok(next(state)); 
-                }
-            }
-            break;
-        case pub: f_pub(next(state)); break;
-        case pre: f_pre(state); break;
-        case lco: f_lco(state); break;
-        case bco: f_bco(state); break;
-        default: f_err(state); break;
-    }
-}
-
-void f_pub(State* state) {
-    state->phrase.is_public = true;
-    switch (symbol(state)) {
-        case tok: {
-                Element* e = state->input;
-                if (is_struct_union_enum(e)) {
-                    f_struct_union_enum(next(state));
-                } else if (is_typedef(e)) {
-                    f_typedef(next(state));
-                } else {
-                    f_tok(next(state)); 
-                }
+    // stitch the chunks together, (p, scanner.indent) is the actual state
+    size_t p = 0;
+    bool ok = true;
+    for (int k = 0; k < threads; k++) {
+        ScanChunk* c = chunks + k;
+        ptrdiff_t i = sync_index(c, p, scanner.indent);
+        while (ok && i < 0 && p < c->exit) {
+            Element e = scan_next(&scanner, source_code + p);
+            if (e.type == err) {
+                report_scan_error(filename, &elements, &scanner);
+                ok = false;
+                break;
             }
-            break;
-        case pre: f_pre(state); break;
-        case lco: f_lco(state); break;
-        case bco: f_bco(state); break;
-        default: f_err(state); break;
+            append_element(arena, &elements, e);
+            p = e.end - source_code;
+            i = sync_index(c, p, scanner.indent);
+        }
+        if (ok && i >= 0) {
+            append_elements(arena, &elements, &c->elements, i);
+            p = c->exit;
+            scanner.indent = c->scanner.indent;
+        }
+        arena_free(&c->arena);
     }
-}
+    free(chunks);
 
-void f_tok(State* state) {
-    switch (symbol(state)) {
-        case tok: f_tok(next(state)); break;
-        case sem: f_tok_sem(state); break;
-        case par: f_tok_paren(next(state)); break;
-        case bra: f_tok_bracket(next(state)); break;
-        case asg: f_tok_asg(next(state)); break;
-        case lco: case bco: f_tok(next(state)); break;
-        default: f_err(state); break;
-    }
+    // continue after the last chunk, which reports errors at its exit
+    if (ok) ok = scan_rest(arena, filename, &elements, &scanner, p);
+    *result = elements;
+    return ok;
 }
 
-void f_tok_paren(State* state) {
-    switch (symbol(state)) {
-        case sem: f_tok_paren_sem(state); break;
-        case cur: f_tok_paren_curly(state); break;
-        case lco: case bco: f_tok_paren(next(state)); break;
-        // allow tok par tok par sem (for functions with attributes)
-        case tok: f_tok(next(state)); break;
-        default: f_err(state); break;
+/*
+Like try_get_elements_parallel, but exits if the source text is malformed.
+*/
+ElementTable get_elements_parallel(Arena* arena, char* filename, char* source_code, int threads) {
+    ElementTable elements;
+    if (!try_get_elements_parallel(arena, filename, source_code, threads, &elements)) {
+        exit(EXIT_FAILURE);
     }
+    return elements;
 }
 
-void f_tok_paren_sem(State* state) {
-    state->phrase.type = fun_dec;
+/*
+Checks that the parallel scan of s with 1 to 8 threads produces the same
+elements as a sequential scan.
+*/
+void test_parallel_scan(char* s) {
+    Arena arena = make_arena(1024);
+    ElementTable expected = get_elements_parallel(&arena, "test", s, 1);
+    for (int threads = 2; threads <= 8; threads++) {
+        ElementTable actual = get_elements_parallel(&arena, "test", s, threads);
+        test_equal_i(actual.count, expected.count);
+        if (actual.count == expected.count) {
+            ptrdiff_t n = expected.count;
+            test_equal_i(memcmp(actual.types, expected.types, n), 0);
+            test_equal_i(memcmp(actual.begins, expected.begins, n * sizeof(size_t)), 0);
+            test_equal_i(memcmp(actual.lengths, expected.lengths, n * sizeof(size_t)), 0);
+        }
+    }
+    arena_free(&arena);
 }
 
-void f_tok_paren_curly(State* state) {
-    state->phrase.type = fun_def;
-}
+void get_elements_parallel_test(void) {
+    test_parallel_scan("");
+    test_parallel_scan("\n\n\n\n\n\n\n\n\n\n");
+    test_parallel_scan("int a;\nint b;\nint c;\nint d;\n*int e;\nint f;\nint g;\nint h;\n");
+    // chunks that begin within groups, comments, literals, and directives
+    test_parallel_scan("int f(void) {\n  a;\n  b;\n  c;\n  d;\n}\nint g;\nint h = {\n1,\n2};\n");
+    test_parallel_scan("/*\na;\nb;\nc;\nd;\n*/\nint x;\n/* \n*\n*/ int y;\n// z\n");
+    test_parallel_scan("char* s = \"a\\\nb\\\nc\\\nd\\\ne\";\nint x;\n  \\\n*int y;\n");
+    test_parallel_scan("#define X \\\n  1 \\\n  2 \\\n  3\n#if X\nint x;\n#endif\n *int y;\n");
+    test_parallel_scan("int f() {\n{\n{\n(\n[\n]\n)\n}\n}\n}\nint g() {\n\n\n\n}\n");
+    // whitespace and directives that continue across chunk boundaries
+    test_parallel_scan("int a; \\\n  b;\nint c; \\\n\\\n d;\nint e;\n#x \\\n\\\ny\n");
 
-void f_tok_sem(State* state) {
-    state->phrase.type = var_dec;
+    // a speculative scan stops at the end of its chunk
+    char* s = "int a;\n{\nint b;\n}\n#x \\\n y\n";
+    ScanChunk c = {make_scanner(), make_arena(1024), {s, 0, 0, NULL, NULL, NULL, NULL}, 7, 16, 0, false};
+    scan_chunk(&c);
+    test_equal_i(c.exit, 7);
+    test_equal_i(c.failed, true);
+    arena_free(&c.arena);
+    c = (ScanChunk){make_scanner(), make_arena(1024), {s, 0, 0, NULL, NULL, NULL, NULL}, 18, 23, 0, false};
+    scan_chunk(&c);
+    test_equal_i(c.exit, 18);
+    test_equal_i(c.failed, false);
+    arena_free(&c.arena);
 }
 
-void f_tok_asg(State* state) {
-    switch (symbol(state)) {
-        case sem: f_tok_asg_sem(state); break;
-        default: f_tok_asg(next(state)); break;
-    }
+/*
+Returns the number of online processors.
+*/
+int processor_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n;
 }
 
-void f_tok_asg_sem(State* state) {
-    state->phrase.type = var_def;
+/*
+Parses the source text into a table of elements. Large source texts are
+scanned on up to the given number of threads, but on no more than one thread
+per processor. The table is allocated from the arena. Reports the error and
+returns false if the source text is malformed.
+*/
+bool try_get_elements(Arena* arena, char* filename, char* source_code, int max_threads,
+        ElementTable* result) {
+    require_not_null(source_code);
+    require("positive", max_threads > 0);
+    size_t length = strlen(source_code);
+    size_t threads = length / SCAN_CHUNK_MIN;
+    if (threads > max_threads) threads = max_threads;
+    if (threads > processor_count()) threads = processor_count();
+    if (threads < 1) threads = 1;
+    return try_get_elements_parallel(arena, filename, source_code, threads, result);
 }
 
-void f_tok_bracket(State* state) {
-    switch (symbol(state)) {
-        case sem: f_tok_bracket_sem(state); break;
-        case bra: f_tok_bracket(next(state)); break;
-        case asg: f_tok_bracket_asg(next(state)); break;
-        case lco: case bco: f_tok_bracket(next(state)); break;
-        default: f_err(state); break;
+/*
+Like try_get_elements, but exits if the source text is malformed.
+*/
+ElementTable get_elements(Arena* arena, char* filename, char* source_code, int max_threads) {
+    ElementTable elements;
+    if (!try_get_elements(arena, filename, source_code, max_threads, &elements)) {
+        exit(EXIT_FAILURE);
     }
+    return elements;
 }
 
-void f_tok_bracket_sem(State* state) {
-    state->phrase.type = arr_dec;
+// Is element i a struct or union or enum token?
+bool is_struct_union_enum(ElementTable* table, ptrdiff_t i) {
+    if (i >= table->count) return false;
+    Keyword k = table->keywords[i];
+    return k == kw_struct || k == kw_union || k == kw_enum;
 }
 
-void f_tok_bracket_asg(State* state) {
-    switch (symbol(state)) {
-        case sem: f_tok_bracket_asg_sem(state); break;
-        default: f_tok_bracket_asg(next(state)); break;
-    }
+bool is_typedef(ElementTable* table, ptrdiff_t i) {
+    return i < table->count && table->keywords[i] == kw_typedef;
 }
 
-void f_tok_bracket_asg_sem(State* state) {
-    state->phrase.type = arr_def;
+/*
+Returns the index of the next element, starting at i, that is neither whi nor
+lbr; or table->count if there is no such element.
+*/
+ptrdiff_t skip_whi_lbr(ElementTable* table, ptrdiff_t i) {
+    require_not_null(table);
+    for (; i < table->count; i++) {
+        unsigned char t = table->types[i];
+        if (t != whi && t != lbr) {
+            return i;
+        }
+    }
+    return table->count;
 }
 
-void f_struct_union_enum(State* state) {
-    switch (symbol(state)) {
-        case sem: f_struct_union_enum_sem(state); break;
-        default: f_struct_union_enum(next(state)); break;
+/*
+Returns the index of the next element, starting at i, that is neither whi nor
+lbr nor sem; or table->count if there is no such element.
+*/
+ptrdiff_t skip_whi_lbr_sem(ElementTable* table, ptrdiff_t i) {
+    require_not_null(table);
+    for (; i < table->count; i++) {
+        unsigned char t = table->types[i];
+        if (t != whi && t != lbr && t != sem) {
+            return i;
+        }
     }
+    return table->count;
 }
 
-void f_struct_union_enum_sem(State* state) {
-    state->phrase.type = struct_union_enum_def;
-}
+static const char* PhraseTypeNames[] = {
+    "unknown", "error", "fun_dec", "fun_def", "var_dec", "var_def", "arr_dec", "arr_def", 
+    "struct_union_enum_def", "type_def", "preproc", "line_comment", "block_comment"
+};
 
-void f_typedef(State* state) {
-    switch (symbol(state)) {
-        case sem: f_typedef_sem(state); break;
-        default: f_typedef(next(state)); break;
+/*
+Prints the phrase in the format [*PhraseType:<phrase contents>] followed by a
+line break. The '*' indicates a public phrase.
+*/
+void print_phrase(ElementTable* table, Phrase* phrase) {
+    require_not_null(table);
+    require_not_null(phrase);
+    printf("[%s%s:", phrase->is_public ? "*" : "", PhraseTypeNames[phrase->type]);
+    ptrdiff_t e = phrase->first;
+    ptrdiff_t f = phrase->last;
+    if (e < table->count && f < table->count) {
+        char* p = element_begin(table, e);
+        char* q = element_end(table, f);
+        print_string(make_string2(p, q - p));
     }
+    printf("]\n");
 }
 
-void f_typedef_sem(State* state) {
-    state->phrase.type = type_def;
+/*
+Returns the current input symbol; or eos if the end of the input has been
+reached.
+*/
+ElementType symbol(State* s) {
+    require_not_null(s);
+    return element_type(s->elements, s->input);
 }
 
-void f_pre(State* state) {
-    state->phrase.type = preproc;
-}
+/*
+The phrase recognizer is a finite automaton driven by a loop. The transition
+table maps the parser state and the current input symbol to either a shift
+(consume the symbol and go to the next state) or an accept (the phrase is
+complete, its last element is the current symbol). Symbols without an entry
+use the default transition of the state. Stack use is constant, regardless of
+the length of the phrase.
+*/
 
-void f_lco(State* state) {
-    state->phrase.type = line_comment;
-}
+#define SHIFT(state, anchor) {t_shift, state, anchor}
+#define ACCEPT(type, anchor) {t_accept, type, anchor}
 
-void f_bco(State* state) {
-    state->phrase.type = block_comment;
-}
+static const Transition transitions[ParserStateCount][SymbolCount] = {
+    [p_start] = {
+        [tok] = SHIFT(p_tok, a_name),
+        [sue_kw] = SHIFT(p_struct_union_enum, a_none),
+        [typedef_kw] = SHIFT(p_typedef, a_none),
+        [pub] = SHIFT(p_pub, a_public),
+        [pre] = ACCEPT(preproc, a_none),
+        [lco] = ACCEPT(line_comment, a_none),
+        [bco] = ACCEPT(block_comment, a_none),
+    },
+    [p_pub] = {
+        [tok] = SHIFT(p_tok, a_name),
+        [sue_kw] = SHIFT(p_struct_union_enum, a_none),
+        [typedef_kw] = SHIFT(p_typedef, a_none),
+        [pre] = ACCEPT(preproc, a_none),
+        [lco] = ACCEPT(line_comment, a_none),
+        [bco] = ACCEPT(block_comment, a_none),
+    },
+    [p_tok] = {
+        [tok] = SHIFT(p_tok, a_name),
+        [sem] = ACCEPT(var_dec, a_none),
+        [par] = SHIFT(p_tok_paren, a_none),
+        [bra] = SHIFT(p_tok_bracket, a_none),
+        [asg] = SHIFT(p_tok_asg, a_asg),
+        [lco] = SHIFT(p_tok, a_none),
+        [bco] = SHIFT(p_tok, a_none),
+    },
+    [p_tok_paren] = {
+        [sem] = ACCEPT(fun_dec, a_none),
+        [cur] = ACCEPT(fun_def, a_body),
+        [lco] = SHIFT(p_tok_paren, a_none),
+        [bco] = SHIFT(p_tok_paren, a_none),
+        // allow tok par tok par sem (for functions with attributes)
+        [tok] = SHIFT(p_tok, a_name),
+    },
+    [p_tok_asg] = {
+        [sem] = ACCEPT(var_def, a_none),
+        [eos] = ACCEPT(error, a_none),
+    },
+    [p_tok_bracket] = {
+        [sem] = ACCEPT(arr_dec, a_none),
+        [bra] = SHIFT(p_tok_bracket, a_none),
+        [asg] = SHIFT(p_tok_bracket_asg, a_asg),
+        [lco] = SHIFT(p_tok_bracket, a_none),
+        [bco] = SHIFT(p_tok_bracket, a_none),
+    },
+    [p_tok_bracket_asg] = {
+        [sem] = ACCEPT(arr_def, a_none),
+        [eos] = ACCEPT(error, a_none),
+    },
+    [p_struct_union_enum] = {
+        [sem] = ACCEPT(struct_union_enum_def, a_none),
+        [eos] = ACCEPT(error, a_none),
+    },
+    [p_typedef] = {
+        [sem] = ACCEPT(type_def, a_none),
+        [eos] = ACCEPT(error, a_none),
+    },
+};
+
+static const Transition default_transitions[ParserStateCount] = {
+    [p_start] = ACCEPT(error, a_none),
+    [p_pub] = ACCEPT(error, a_none),
+    [p_tok] = ACCEPT(error, a_none),
+    [p_tok_paren] = ACCEPT(error, a_none),
+    [p_tok_asg] = SHIFT(p_tok_asg, a_none),
+    [p_tok_bracket] = ACCEPT(error, a_none),
+    [p_tok_bracket_asg] = SHIFT(p_tok_bracket_asg, a_none),
+    [p_struct_union_enum] = SHIFT(p_struct_union_enum, a_none),
+    [p_typedef] = SHIFT(p_typedef, a_none),
+};
 
-void f_err(State* state) {
-    state->phrase.type = error;
+/*
+Returns the input symbol for the transition table. At the beginning of a
+phrase, "struct", "union", "enum", and "typedef" tokens are distinguished from
+other tokens.
+*/
+int input_symbol(State* s, ParserState p) {
+    ElementType t = symbol(s);
+    if (t == tok && (p == p_start || p == p_pub)) {
+        if (is_struct_union_enum(s->elements, s->input)) return sue_kw;
+        if (is_typedef(s->elements, s->input)) return typedef_kw;
+    }
+    return t;
 }
 
 /*
-Returns the next phrase starting at the given element.
+Returns the next phrase starting at element i.
 */
-Phrase get_phrase(Element* list) {
-    require_not_null(list);
-    State state = (State){list, (Phrase){unknown, false, list, list}};
+Phrase get_phrase(ElementTable* table, ptrdiff_t i) {
+    require_not_null(table);
+    require("valid index", 0 <= i && i < table->count);
+    State state = (State){table, i, (Phrase){unknown, false, i, i, -1, -1, -1}};
     // skip initial whitespace
-    state.input = skip_whi_lbr(state.input);
-    f_start(&state); 
+    state.input = skip_whi_lbr(table, state.input);
+    ParserState p = p_start;
+    while (true) {
+        Transition t = transitions[p][input_symbol(&state, p)];
+        if (t.kind == t_default) t = default_transitions[p];
+        switch (t.anchor) {
+            case a_none: break;
+            case a_public: state.phrase.is_public = true; break;
+            case a_name: state.phrase.name = state.input; break;
+            case a_asg: state.phrase.asg = state.input; break;
+            case a_body: state.phrase.body = state.input; break;
+        }
+        if (t.kind == t_accept) {
+            state.phrase.type = t.target;
+            break;
+        }
+        // consume the symbol, go to next non-whitespace and non-linebreak
+        p = t.target;
+        state.input = skip_whi_lbr(table, state.input + 1);
+    }
     state.phrase.last = state.input;
     return state.phrase;
 }
@@ -726,16 +1524,17 @@ Phrase get_phrase(Element* list) {
     base_test_phrase(__FILE__, __LINE__, source_code, type, public)
 
 bool base_test_phrase(char* file, int line, char* s, PhraseType type, bool public) {
-    indent = true;
     printf("\n%s\n", s);
-    ElementList elements = get_elements("", s);
+    Arena arena = make_arena(1024);
+    ElementTable elements = get_elements(&arena, "", s, 1);
     // print_elements(&elements);
-    Phrase p = get_phrase(elements.first);
-    print_phrase(&p);
+    Phrase p = get_phrase(&elements, 0);
+    print_phrase(&elements, &p);
     bool ok1 = base_test_equal_i(file, line, p.type, type);
     if (!ok1) printf("\t\ttypes: actual = %s, expected = %s\n", 
             PhraseTypeNames[p.type], PhraseTypeNames[type]);
     bool ok2 = base_test_equal_i(file, line, p.is_public, public);
+    arena_free(&arena);
     return ok1 && ok2;
 }
 
@@ -791,308 +1590,3190 @@ void get_phrase_test(void) {
     test_phrase("*typedef struct {double x; double y;} Point;X", type_def, true);
     test_phrase("*typedef struct Point {double x; double y;} Point;X", type_def, true);
     test_phrase("*typedef char[ID_LEN] Ident;", type_def, true);
+
+    // phrases that are not terminated before the end of the source
+    test_phrase("int i = 123", error, false);
+    test_phrase("int a[] = {1, 2, 3}", error, false);
+    test_phrase("struct Point{int x; int y;}", error, false);
+    test_phrase("typedef void* Any", error, false);
+}
+
+#define test_anchor(source_code, anchor, content) \
+    base_test_anchor(__FILE__, __LINE__, source_code, \
+            offsetof(Phrase, anchor), content)
+
+bool base_test_anchor(char* file, int line, char* s, size_t offset, char* content) {
+    Arena arena = make_arena(1024);
+    ElementTable elements = get_elements(&arena, "", s, 1);
+    Phrase p = get_phrase(&elements, 0);
+    ptrdiff_t i = *(ptrdiff_t*)((char*)&p + offset);
+    String actual = make_string("");
+    if (i >= 0) actual = make_string2(element_begin(&elements, i), elements.lengths[i]);
+    bool ok = base_test_equal_s(file, line, actual, content);
+    arena_free(&arena);
+    return ok;
+}
+
+void phrase_anchors_test(void) {
+    test_anchor("int f(int i);X", name, "f");
+    test_anchor("*static int * f(int* i){return 2*i;}X", name, "f");
+    test_anchor("int f(int i) __attribute__((x));X", name, "__attribute__");
+    test_anchor("int f(int i)\n{return 2*i;}X", body, "{return 2*i;}");
+    test_anchor("int f(int i);X", body, "");
+    test_anchor("int i = 123;X", asg, "=");
+    test_anchor("int a[2] = {1, 2};X", asg, "=");
+    test_anchor("int i;X", asg, "");
 }
 
 /*
-Prints the list of phrases.
+Appends the phrase to the table. The array of the table is allocated from the
+arena and is released together with it.
 */
-void print_phrases(Element* list) {
-    require_not_null(list);
-    Element* e = list;
-    while (e != NULL) {
-        e = skip_whi_lbr_sem(e);
-        if (e == NULL) break;
-        Phrase phrase = get_phrase(e);
-        print_phrase(&phrase);
-        e = phrase.last;
-        if (e == NULL) break;
-        e = e->next;
+void append_phrase(Arena* arena, PhraseTable* phrases, Phrase phrase) {
+    require_not_null(arena);
+    require_not_null(phrases);
+    ptrdiff_t n = phrases->count;
+    if (n >= phrases->cap) {
+        // grow the array, the old one is released with the arena
+        ptrdiff_t cap = phrases->cap < 256 ? 256 : 2 * phrases->cap;
+        Phrase* a = arena_alloc(arena, cap * sizeof(Phrase));
+        if (n > 0) memcpy(a, phrases->a, n * sizeof(Phrase));
+        phrases->a = a;
+        phrases->cap = cap;
     }
+    phrases->a[n] = phrase;
+    phrases->count = n + 1;
 }
 
 /*
-Starting from begin, appends the contents of all elements until stop returns
-true. Does not append the contents of the element for which stop returns true.
+Groups elements first, first + 1, ..., stop - 1 into phrases and appends them
+to the table. Phrases that begin in the range do not extend beyond a
+semicolon. Returns the index of the element at which the first erroneous
+phrase ends, or -1 if there is none.
 */
-void xappend_string_until(String* str, Element* first, bool stop(Element*)) {
-    if (first == NULL || stop(first)) return;
-    Element* last = first;
-    for (Element* e = first; e != NULL && !stop(e); e = e->next) {
-        if (e->type != whi) {
-            last = e;
+ptrdiff_t append_phrases(Arena* arena, ElementTable* table, ptrdiff_t first, ptrdiff_t stop, 
+        PhraseTable* phrases) {
+    require_not_null(arena);
+    require_not_null(table);
+    require_not_null(phrases);
+    require("valid range", 0 <= first && first <= stop && stop <= table->count);
+    ptrdiff_t e = first;
+    while (e < stop) {
+        e = skip_whi_lbr_sem(table, e);
+        if (e >= stop) break;
+        Phrase phrase = get_phrase(table, e);
+        if (DEBUG) printf("phrase = %s\n", PhraseTypeNames[phrase.type]);
+        if (phrase.type == error) {
+            if (phrase.last < table->count) e = phrase.last;
+            return e;
         }
+        append_phrase(arena, phrases, phrase);
+        e = phrase.last + 1;
     }
-    xappend_cstring2(str, first->begin, last->end);
+    return -1;
 }
 
 /*
-Creates header file contents for the given list of elements.
+Reports the line of the erroneous phrase that ends at element e.
 */
-String create_header(/*in*/String basename, /*in*/Element* list) {
-    require_not_null(list);
-    String head = new_string(1024);
-    xappend_cstring(&head, "#ifndef ");
-    xappend_string(&head, basename);
-    xappend_cstring(&head, "_h_INCLUDED\n#define ");
-    xappend_string(&head, basename);
-    xappend_cstring(&head, "_h_INCLUDED\n");
-    Element* e = list;
-    while (e != NULL) {
-        e = skip_whi_lbr_sem(e);
-        if (e == NULL) break;
-        Phrase phrase = get_phrase(e);
-        if (DEBUG) printf("phrase = %s\n", PhraseTypeNames[phrase.type]);
-        if (DEBUG) xappend_cstring(&head, "phrase = ");
-        if (DEBUG) xappend_cstring(&head, (char*)PhraseTypeNames[phrase.type]);
-        if (DEBUG) xappend_char(&head, '\n');
-        if (phrase.type == error) {
-            if (phrase.last != NULL) e = phrase.last;
-            int line = count_line_breaks(list->begin, e->end) + 1;
-            fprintf(stderr, "%s:%d: Error\n", basename.s, line);
-            exit(EXIT_FAILURE);
-        }
-        if (phrase.is_public) {
-            Element* first = phrase.first->next; // skip pub
-            Element* last = phrase.last;
-            if (DEBUG) xappend_cstring2(&head, first->begin, last->end);
-            if (DEBUG) xappend_char(&head, '\n');
-            switch (phrase.type) {
-                case var_dec:
-                case arr_dec:
-                    xappend_cstring(&head, "extern ");
-                    xappend_cstring2(&head, first->begin, last->end);
-                    xappend_char(&head, '\n');
-                    break;
-                case fun_dec:
-                case preproc:
-                    xappend_cstring2(&head, first->begin, last->end);
-                    xappend_char(&head, '\n');
-                    break;
-                case fun_def:
-                    xappend_string_until(&head, first, is_curly);
-                    xappend_cstring(&head, ";\n");
-                    break;
-                case var_def:
-                case arr_def:
-                    xappend_cstring(&head, "extern ");
-                    xappend_string_until(&head, first, is_asg);
-                    xappend_cstring(&head, ";\n");
-                    break;
-                case struct_union_enum_def:
-                case type_def:
-                    xappend_cstring2(&head, first->begin, last->end);
-                    xappend_char(&head, '\n');
-                    break;
-                case line_comment:
-                case block_comment:
-                    xappend_cstring2(&head, first->begin, last->end);
-                    xappend_char(&head, '\n');
-                    break;
-                default:
-                    xappend_cstring(&head, "// phrase ");
-                    xappend_cstring(&head, (char*)PhraseTypeNames[phrase.type]);
-                    xappend_cstring(&head, " NOT HANDLED\n");
-                    break;
-            }
-        }
-        //print_phrase(&phrase);
-        e = phrase.last;
-        if (e == NULL) break;
-        e = e->next;
+void report_phrase_error(char* filename, ElementTable* table, ptrdiff_t e) {
+    ptrdiff_t line = line_of(&table->lines, element_end(table, e) - table->source);
+    fprintf(stderr, "%s:%td: Error\n", filename, line);
+}
+
+/*
+Groups the elements into phrases. The table is allocated from the arena.
+Reports the line of the first erroneous phrase and returns false in case of an
+error.
+*/
+bool try_get_phrases(Arena* arena, char* filename, ElementTable* table, PhraseTable* result) {
+    require_not_null(arena);
+    require_not_null(filename);
+    require_not_null(table);
+    require_not_null(result);
+    *result = (PhraseTable){0, 0, NULL};
+    ptrdiff_t e = append_phrases(arena, table, 0, table->count, result);
+    if (e >= 0) {
+        report_phrase_error(filename, table, e);
+        return false;
     }
-    xappend_cstring(&head, "#endif\n");
-    return head;
+    return true;
 }
 
 /*
-If phrase is a function definition or a function declaration, returns the
-function name. Otherwise returns the empty string.
+Like try_get_phrases, but exits in case of an error.
 */
-String fun_name(Phrase phrase) {
-    if (phrase.type == fun_def || phrase.type == fun_dec) {
-        // last token in phrase is function name
-        Element* token = NULL;
-        for (Element* e = phrase.first; e != NULL && e != phrase.last; e = e->next) {
-            if (e->type == tok) {
-                token = e;
-            }
-        };
-        if (token != NULL) {
-            return make_string2(token->begin, token->end - token->begin);
-        }
+PhraseTable get_phrases(Arena* arena, char* filename, ElementTable* table) {
+    PhraseTable phrases;
+    if (!try_get_phrases(arena, filename, table, &phrases)) exit(EXIT_FAILURE);
+    return phrases;
+}
+
+/*
+Prints the list of phrases.
+*/
+void print_phrases(ElementTable* table, PhraseTable* phrases) {
+    require_not_null(table);
+    require_not_null(phrases);
+    for (ptrdiff_t i = 0; i < phrases->count; i++) {
+        print_phrase(table, &phrases->a[i]);
     }
-    return make_string("");
 }
 
 /*
-Creates implementation file contents for the given list of elements. Maintains
-the line numbers of the original contents.
+Appends the contents of the elements from first (inclusive) to stop
+(exclusive), without trailing whitespace.
+*/
+void xappend_segment_until(Segments* segs, ElementTable* table, ptrdiff_t first, ptrdiff_t stop) {
+    require("valid range", 0 <= first && first <= stop && stop <= table->count);
+    ptrdiff_t last = stop - 1;
+    while (last > first && table->types[last] == whi) last--;
+    if (last < first) return;
+    xappend_segment(segs, element_begin(table, first), element_end(table, last));
+}
+
+/*
+Appends the header file contents for the phrase to head.
 */
-String create_impl(/*in*/String basename, /*in*/Element* list) {
-    require_not_null(list);
-    int lines;
-    String impl = new_string(1024);
-    Element* e = list;
-    while (e != NULL) {
-        Element* f = skip_whi_lbr_sem(e);
-        if (f == NULL) {
-            xappend_cstring(&impl, e->begin);
+void append_header_phrase(Segments* head, ElementTable* table, Phrase* phrase) {
+    require_not_null(head);
+    require_not_null(table);
+    require_not_null(phrase);
+    if (!phrase->is_public) return;
+    char* first = element_begin(table, phrase->first + 1); // skip pub
+    char* last = element_end(table, phrase->last);
+    if (DEBUG) xappend_segment(head, first, last);
+    if (DEBUG) xappend_segment_cstring(head, "\n");
+    switch (phrase->type) {
+        case var_dec:
+        case arr_dec:
+            xappend_segment_cstring(head, "extern ");
+            xappend_segment(head, first, last);
+            xappend_segment_cstring(head, "\n");
             break;
-        } else {
-            xappend_cstring2(&impl, e->begin, f->begin);
-            e = f;
+        case fun_dec:
+        case preproc:
+            xappend_segment(head, first, last);
+            xappend_segment_cstring(head, "\n");
+            break;
+        case fun_def:
+            xappend_segment_until(head, table, phrase->first + 1, phrase->body);
+            xappend_segment_cstring(head, ";\n");
+            break;
+        case var_def:
+        case arr_def:
+            xappend_segment_cstring(head, "extern ");
+            xappend_segment_until(head, table, phrase->first + 1, phrase->asg);
+            xappend_segment_cstring(head, ";\n");
+            break;
+        case struct_union_enum_def:
+        case type_def:
+            xappend_segment(head, first, last);
+            xappend_segment_cstring(head, "\n");
+            break;
+        case line_comment:
+        case block_comment:
+            xappend_segment(head, first, last);
+            xappend_segment_cstring(head, "\n");
+            break;
+        default:
+            xappend_segment_cstring(head, "// phrase ");
+            xappend_segment_cstring(head, (char*)PhraseTypeNames[phrase->type]);
+            xappend_segment_cstring(head, " NOT HANDLED\n");
+            break;
+    }
+}
+
+/*
+Appends the implementation file contents for the phrase to impl. Maintains the
+line numbers of the original contents.
+*/
+void append_impl_phrase(Segments* impl, ElementTable* table, Phrase* phrase) {
+    require_not_null(impl);
+    require_not_null(table);
+    require_not_null(phrase);
+    ptrdiff_t lines;
+    if (phrase->is_public) {
+        char* first = element_begin(table, phrase->first + 1); // skip pub
+        char* last = element_end(table, phrase->last);
+        if (DEBUG) xappend_segment(impl, first, last);
+        switch (phrase->type) {
+            case var_dec:
+            case var_def:
+            case fun_dec:
+            case fun_def:
+            case arr_dec:
+            case arr_def:
+                xappend_segment(impl, first, last);
+                break;
+            case struct_union_enum_def:
+            case type_def:
+            case preproc:
+                lines = count_line_breaks(&table->lines, 
+                        first - table->source, last - table->source);
+                xappend_segment_newlines(impl, lines);
+                break;
+            default:
+                xappend_segment(impl, first, last);
+                break;
         }
-        Phrase phrase = get_phrase(e);
-        if (DEBUG) printf("phrase = %s\n", PhraseTypeNames[phrase.type]);
-        if (DEBUG) xappend_cstring(&impl, "phrase = ");
-        if (DEBUG) xappend_cstring(&impl, (char*)PhraseTypeNames[phrase.type]);
-        if (DEBUG) xappend_char(&impl, '\n');
-        if (phrase.type == error) {
-            if (phrase.last != NULL) e = phrase.last;
-            int line = count_line_breaks(list->begin, e->end) + 1;
-            fprintf(stderr, "%s:%d: Error\n", basename.s, line);
-            exit(EXIT_FAILURE);
-        }
-        if (phrase.is_public) {
-            Element* first = phrase.first->next; // skip pub
-            Element* last = phrase.last;
-            if (DEBUG) xappend_cstring2(&impl, first->begin, last->end);
-            switch (phrase.type) {
-                case var_dec:
-                case var_def:
-                case fun_dec:
-                case fun_def:
-                case arr_dec:
-                case arr_def:
-                    xappend_cstring2(&impl, first->begin, last->end);
-                    break;
-                case struct_union_enum_def:
-                case type_def:
-                case preproc:
-                    lines = count_line_breaks(first->begin, last->end);
-                    for (int i = 0; i < lines; i++) xappend_char(&impl, '\n');
-                    break;
-                default:
-                    xappend_cstring2(&impl, first->begin, last->end);
-                    break;
-            }
-        } else { // not public
-            Element* first = phrase.first;
-            Element* last = phrase.last;
-            if (DEBUG) xappend_cstring2(&impl, first->begin, last->end);
-            if (DEBUG) xappend_char(&impl, '\n');
-            switch (phrase.type) {
-                case fun_dec:
-                case fun_def:
-                    // do not put "static" in front of the main function
-                    if (!cstring_equal(fun_name(phrase), "main")) {
-                        xappend_cstring(&impl, "static ");
-                    }
-                    xappend_cstring2(&impl, first->begin, last->end);
-                    break;
-                case var_dec:
-                case var_def:
-                case arr_dec:
-                case arr_def:
-                    xappend_cstring(&impl, "static ");
-                    xappend_cstring2(&impl, first->begin, last->end);
-                    break;
-                case struct_union_enum_def:
-                case type_def:
-                case preproc:
-                    xappend_cstring2(&impl, first->begin, last->end);
-                    break;
-                default:
-                    xappend_cstring2(&impl, first->begin, last->end);
-                    break;
-            }
+    } else { // not public
+        char* first = element_begin(table, phrase->first);
+        char* last = element_end(table, phrase->last);
+        if (DEBUG) xappend_segment(impl, first, last);
+        if (DEBUG) xappend_segment_cstring(impl, "\n");
+        switch (phrase->type) {
+            case fun_dec:
+            case fun_def:
+                // do not put "static" in front of the main function
+                if (phrase->name < 0 || table->keywords[phrase->name] != kw_main) {
+                    xappend_segment_cstring(impl, "static ");
+                }
+                xappend_segment(impl, first, last);
+                break;
+            case var_dec:
+            case var_def:
+            case arr_dec:
+            case arr_def:
+                xappend_segment_cstring(impl, "static ");
+                xappend_segment(impl, first, last);
+                break;
+            case struct_union_enum_def:
+            case type_def:
+            case preproc:
+                xappend_segment(impl, first, last);
+                break;
+            default:
+                xappend_segment(impl, first, last);
+                break;
         }
-        //print_phrase(&phrase);
-        e = phrase.last;
-        if (e == NULL) break;
-        e = e->next;
     }
-    return impl;
 }
 
-int main(int argc, char* argv[]) {
-    // split_test();
-    // split_lines_test();
-    // indentation_test();
-    // next_state_test();
-    // trim_test();
-    // trim_left_test();
-    // trim_right_test();
-    // index_of_test();
-    // append_test();
-    // xappend_test();
-    // scan_next_test();
-    // get_phrase_test();
-    // exit(0);
+/*
+Appends the contents of the phrases to the header file contents and the source
+text from begin to end, with the phrases replaced, to the implementation file
+contents. The phrases lie between begin and end. A change to the outputs needs
+a new OUTPUT_VERSION (see output_version_test).
+*/
+void append_outputs(ElementTable* table, PhraseTable* phrases, char* begin, char* end, 
+        /*out*/Segments* head, /*out*/Segments* impl) {
+    require_not_null(table);
+    require_not_null(phrases);
+    require_not_null(head);
+    require_not_null(impl);
+    // the text between phrases (whitespace, line breaks, semicolons) is 
+    // copied to the implementation file
+    char* gap = begin;
+    for (ptrdiff_t i = 0; i < phrases->count; i++) {
+        Phrase* phrase = &phrases->a[i];
+        char* first = element_begin(table, phrase->first);
+        xappend_segment(impl, gap, first);
+        if (DEBUG) xappend_segment_cstring(head, "phrase = ");
+        if (DEBUG) xappend_segment_cstring(head, (char*)PhraseTypeNames[phrase->type]);
+        if (DEBUG) xappend_segment_cstring(head, "\n");
+        append_header_phrase(head, table, phrase);
+        append_impl_phrase(impl, table, phrase);
+        gap = element_end(table, phrase->last);
+    }
+    xappend_segment(impl, gap, end);
+}
 
-    if (argc != 2) {
-        printf("Usage: headify <filename C file>\n");
-        exit(EXIT_FAILURE);
+/*
+Appends the beginning of the include guard to the header file contents.
+*/
+void append_header_prologue(Segments* head, String basename) {
+    xappend_segment_cstring(head, "#ifndef ");
+    xappend_segment_string(head, basename);
+    xappend_segment_cstring(head, "_h_INCLUDED\n#define ");
+    xappend_segment_string(head, basename);
+    xappend_segment_cstring(head, "_h_INCLUDED\n");
+}
+
+/*
+Creates the header file contents and the implementation file contents in a
+single traversal of the phrases. The implementation file maintains the line
+numbers of the original contents.
+*/
+void create_outputs(/*in*/String basename, /*in*/ElementTable* table, 
+        /*in*/PhraseTable* phrases, /*out*/Segments* head, /*out*/Segments* impl) {
+    require_not_null(table);
+    require_not_null(phrases);
+    require_not_null(head);
+    require_not_null(impl);
+    append_header_prologue(head, basename);
+    char* end = table->source + strlen(table->source);
+    append_outputs(table, phrases, table->source, end, head, impl);
+    xappend_segment_cstring(head, "#endif\n");
+}
+
+/*
+Minimum number of elements per thread of a parallel parse, which is only used
+with --threads. Smaller element tables are parsed on a single thread.
+*/
+#define PARSE_PARTITION_MIN (1 << 20)
+
+/*
+Groups the elements of the partition into phrases and creates the partition's
+part of the header file contents and of the implementation file contents.
+*/
+void* parse_partition(void* arg) {
+    Partition* p = arg;
+    ElementTable* table = p->elements;
+    p->error = append_phrases(&p->arena, table, p->first, p->stop, &p->phrases);
+    if (p->error >= 0) return NULL;
+    append_outputs(table, &p->phrases, p->begin, p->end, &p->head, &p->impl);
+    return NULL;
+}
+
+/*
+Creates the header file contents and the implementation file contents like
+get_phrases and create_outputs, using the given number of threads. The element
+table is split into partitions after semicolons. No phrase extends beyond a
+semicolon, so the partitions are grouped into phrases independently. The parts
+of the contents are concatenated in order. Reports the line of the first
+erroneous phrase and returns false in case of an error.
+*/
+bool create_outputs_parallel(/*in*/char* filename, /*in*/String basename, 
+        /*in*/ElementTable* table, int threads, /*out*/Segments* head, /*out*/Segments* impl) {
+    require_not_null(filename);
+    require_not_null(table);
+    require("positive", threads > 0);
+    require_not_null(head);
+    require_not_null(impl);
+    Partition* partitions = xcalloc(threads, sizeof(Partition));
+    char* begin = table->source;
+    char* source_end = table->source + strlen(table->source);
+    ptrdiff_t first = 0;
+    for (int k = 0; k < threads; k++) {
+        ptrdiff_t stop = table->count;
+        if (k < threads - 1) {
+            stop = table->count * (k + 1) / threads;
+            if (stop < first) stop = first;
+            while (stop < table->count && table->types[stop] != sem) stop++;
+            if (stop < table->count) stop++;
+        }
+        Partition* p = partitions + k;
+        p->elements = table;
+        p->first = first;
+        p->stop = stop;
+        p->begin = begin;
+        p->end = stop < table->count ? element_begin(table, stop) : source_end;
+        p->arena = make_arena(16 * 1024);
+        p->head = new_segments(256);
+        p->impl = new_segments(256);
+        first = stop;
+        begin = p->end;
     }
 
-    // separate dirname and basename (without extension) from filename
-    String filename = make_string(argv[1]);
-    int idir = last_index_of_char(filename, '/') + 1;
-    String dirname = make_string2(filename.s, idir);
-    bool ends_with_hc = ends_with(filename, make_string(".h.c"));
-    int iext = filename.len;
-    if (ends_with_hc) iext -= 4;
-    String basename = make_string2(filename.s + idir, iext - idir);
-    if (basename.len <= 0) {
-        printf("Usage: headify <filename C file>\n");
-        exit(EXIT_FAILURE);
+    pthread_t* ids = xcalloc(threads, sizeof(pthread_t));
+    for (int k = 1; k < threads; k++) {
+        int r = pthread_create(ids + k, NULL, parse_partition, partitions + k);
+        panicf_if(r != 0, "cannot create parser thread (%d)", r);
     }
-    if (DEBUG) printf("%.*s, %.*s, %.*s\n", 
-            filename.len, filename.s, 
-            dirname.len, dirname.s, 
-            basename.len, basename.s); 
+    parse_partition(partitions);
+    for (int k = 1; k < threads; k++) {
+        pthread_join(ids[k], NULL);
+    }
+    free(ids);
 
-    String source_code = read_file(filename.s);
-    ElementList elements = get_elements(filename.s, source_code.s);
-    if (DEBUG) print_elements(&elements);
+    ptrdiff_t error = -1;
+    for (int k = 0; k < threads && error < 0; k++) error = partitions[k].error;
+    if (error >= 0) {
+        report_phrase_error(filename, table, error);
+    } else {
+        append_header_prologue(head, basename);
+    }
+    for (int k = 0; k < threads; k++) {
+        Partition* p = partitions + k;
+        if (error < 0) {
+            xappend_segments(head, &p->head);
+            xappend_segments(impl, &p->impl);
+        }
+        free_segments(&p->head);
+        free_segments(&p->impl);
+        arena_free(&p->arena);
+    }
+    if (error < 0) xappend_segment_cstring(head, "#endif\n");
+    free(partitions);
+    return error < 0;
+}
 
-#if 0
-    Phrase phrase = get_phrase(elements.first);
-    printf("phrase = %s\n", PhraseTypeNames[phrase.type]);
-    print_phrase(&phrase);
-#endif
+/*
+Checks that the parallel creation of the output contents for s with 1 to 8
+threads produces the same contents as the sequential creation.
+*/
+void test_parallel_outputs(char* s) {
+    Arena arena = make_arena(1024);
+    ElementTable elements = get_elements_parallel(&arena, "test", s, 1);
+    PhraseTable phrases = get_phrases(&arena, "test", &elements);
+    Segments head = new_segments(16);
+    Segments impl = new_segments(16);
+    create_outputs(make_string("test"), &elements, &phrases, &head, &impl);
+    String expected_head = segments_to_string(&head);
+    String expected_impl = segments_to_string(&impl);
+    for (int threads = 1; threads <= 8; threads++) {
+        Segments h = new_segments(16);
+        Segments c = new_segments(16);
+        test_equal_i(create_outputs_parallel("test", make_string("test"), &elements, threads, 
+                &h, &c), true);
+        String actual_head = segments_to_string(&h);
+        String actual_impl = segments_to_string(&c);
+        test_equal_s(actual_head, expected_head.s);
+        test_equal_s(actual_impl, expected_impl.s);
+        free(actual_head.s);
+        free(actual_impl.s);
+        free_segments(&h);
+        free_segments(&c);
+    }
+    free(expected_head.s);
+    free(expected_impl.s);
+    free_segments(&head);
+    free_segments(&impl);
+    arena_free(&arena);
+}
 
-    if (DEBUG) print_phrases(elements.first);
+void create_outputs_parallel_test(void) {
+    test_parallel_outputs("");
+    test_parallel_outputs("int a;");
+    test_parallel_outputs(";;;\n\n;");
+    test_parallel_outputs("*int a;\nint b = 1;\n*int f(int x) {\n  return x;\n}\n*int g(void);\n");
+    test_parallel_outputs("#include <stdio.h>\n*typedef struct P {int x; int y;} P;\n"
+            "*struct Q {\n  int z;\n};\n// comment;\n/* comment; */\n*int a[] = {1, 2};\n"
+            "*int main(void) {\n  puts(\"x;\");\n  return 0;\n}\n");
+}
 
-    String head = create_header(basename, elements.first);
-    String headname = new_string(256);
-    xappend_string(&headname, dirname);
-    xappend_string(&headname, basename);
-    if (ends_with_hc) {
-        xappend_cstring(&headname, ".h");
-    } else {
-        xappend_cstring(&headname, "_headify.h");
+/*
+Punctuators of C, longest first. Comment starts are included, because a
+space has to separate "/" from a following "*" or "/".
+*/
+static const char* Punctuators[] = {
+    "%:%:", "...", "<<=", ">>=", 
+    "->", "++", "--", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", 
+    "*=", "/=", "%=", "+=", "-=", "&=", "^=", "|=", "##", 
+    "<:", ":>", "<%", "%>", "%:", "/*", "//", NULL
+};
+
+/*
+Returns the length of the punctuator at the beginning of s (at least 1).
+*/
+int punctuator_length(char* s) {
+    for (const char** p = Punctuators; *p != NULL; p++) {
+        size_t n = strlen(*p);
+        if (strncmp(s, *p, n) == 0) return n;
+    }
+    return 1;
+}
+
+static bool is_word_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') 
+        || c == '_' || c == '$';
+}
+
+/*
+Returns the end of the string or character literal that starts at s. The
+literal ends at the closing quote or, if it is not terminated, at the end of
+the line.
+*/
+char* skip_literal(char* s, char* end) {
+    char quote = *s++;
+    while (s < end && *s != quote && *s != '\n') {
+        if (*s == '\\' && s + 1 < end) s++;
+        s++;
     }
-    xappend_char(&headname, '\0');
-    write_file(headname.s, head);
-    free(headname.s);
-    free(head.s);
+    return s < end && *s == quote ? s + 1 : s;
+}
 
-    String impl = create_impl(basename, elements.first);
-    String implname = new_string(256);
-    xappend_string(&implname, dirname);
-    xappend_string(&implname, basename);
-    if (ends_with_hc) {
-        xappend_cstring(&implname, ".c");
-    } else {
-        xappend_cstring(&implname, "_headify.c");
+/*
+Returns the end of the comment that starts at s. A line comment ends before
+the line break, unless the line break is escaped.
+*/
+char* skip_comment(char* s, char* end) {
+    if (s[1] == '/') {
+        s += 2;
+        while (s < end && !(*s == '\n' && s[-1] != '\\')) s++;
+        return s;
     }
-    xappend_char(&implname, '\0');
-    write_file(implname.s, impl);
-    free(implname.s);
-    free(impl.s);
+    s += 2;
+    while (s + 1 < end && !(s[0] == '*' && s[1] == '/')) s++;
+    return s + 1 < end ? s + 2 : end;
+}
 
-    elements_free(&elements);
-    free(source_code.s);
-    return 0;
+static bool is_comment(char* s, char* end) {
+    return s + 1 < end && s[0] == '/' && (s[1] == '/' || s[1] == '*');
+}
+
+/*
+Returns true if the block comment from s to t is unterminated, i.e., extends to
+the end of the text.
+*/
+static bool is_open_comment(char* s, char* t) {
+    return s[1] == '*' && !(t - s >= 4 && t[-2] == '*' && t[-1] == '/');
+}
+
+/*
+Returns true if the token from s to t is an unterminated literal.
+*/
+static bool is_open_literal(char* s, char* t) {
+    char* q = s;
+    while (q < t && *q != '"' && *q != '\'') q++;
+    if (q == t) return false;
+    char quote = *q++;
+    while (q < t && *q != quote) {
+        if (*q == '\\' && q + 1 < t) q++;
+        q++;
+    }
+    return q >= t;
+}
+
+/*
+Returns the end of the token that starts at s. Tokens are words (identifiers,
+keywords, and numbers), literals (including their prefixes), and punctuators.
+*/
+char* token_end(char* s, char* end) {
+    char* t = s;
+    if (*t == '"' || *t == '\'') return skip_literal(t, end);
+    bool number = (*t >= '0' && *t <= '9') || (*t == '.' && t + 1 < end && t[1] >= '0' && t[1] <= '9');
+    if (number) {
+        t++;
+        while (t < end) {
+            if ((*t == '+' || *t == '-') && strchr("eEpP", t[-1]) != NULL) t++;
+            else if (is_word_char(*t) || *t == '.') t++;
+            else break;
+        }
+        return t;
+    }
+    if (is_word_char(*t)) {
+        while (t < end && is_word_char(*t)) t++;
+        // encoding prefix of a literal
+        ptrdiff_t n = t - s;
+        if (t < end && (*t == '"' || *t == '\'') && ((n == 1 && strchr("LuU", *s) != NULL) 
+                    || (n == 2 && s[0] == 'u' && s[1] == '8'))) {
+            return skip_literal(t, end);
+        }
+        return t;
+    }
+    ptrdiff_t n = punctuator_length(s);
+    return s + n <= end ? s + n : s + 1;
+}
+
+static bool is_number_token(char* s, ptrdiff_t len) {
+    return (*s >= '0' && *s <= '9') || (*s == '.' && len > 1);
+}
+
+static bool is_word_token(char* s, ptrdiff_t len) {
+    return is_word_char(*s) || *s == '"' || *s == '\'' || is_number_token(s, len);
+}
+
+/*
+Returns true if a space has to be written between the adjacent tokens a and b.
+A space separates tokens that would otherwise run together, for instance two
+words or "-" and "-". The layout adds spaces after commas and semicolons,
+around braces, around assignments, and between closing brackets and words. A
+pointer star is attached to the type ("char* p"). The last character of the
+token before a is given in before, '\0' if there is none.
+*/
+bool needs_space(char before, char* a, ptrdiff_t alen, char* b, ptrdiff_t blen) {
+    bool a_word = is_word_token(a, alen);
+    bool b_word = is_word_token(b, blen);
+    if (a_word && b_word) return true;
+    if (!a_word && !b_word) {
+        char pair[16];
+        ptrdiff_t n = alen < 8 ? alen : 8;
+        memcpy(pair, a, n);
+        memcpy(pair + n, b, blen < 4 ? blen : 4);
+        pair[n + (blen < 4 ? blen : 4)] = '\0';
+        if (punctuator_length(pair) > alen) return true;
+    }
+    if (a[alen - 1] == '.' && *b >= '0' && *b <= '9') return true;
+    if (is_number_token(a, alen) && *b == '.') return true;
+    if (alen == 1 && (*a == ')' || *a == ']' || *a == '}') && b_word) return true;
+    if (alen == 1 && *a == '*' && b_word && before != '\0' && before != '(') return true;
+    if (alen == 1 && (*a == ',' || *a == ';' || *a == '{' || *a == '=')) return true;
+    if (blen == 1 && (*b == '{' || *b == '}' || *b == '=')) return true;
+    return false;
+}
+
+/*
+Appends the preprocessor directive that starts at s to out and returns the end
+of the directive. Runs of whitespace and escaped line breaks become a single
+space, so that the meaning of the directive stays the same. Literals are kept.
+Comments are kept or, if strip_comments is set, replaced by whitespace.
+*/
+char* append_canonical_directive(String* out, char* s, char* end, bool strip_comments) {
+    xappend_char(out, *s++); // '#'
+    bool space = false; // whitespace before the next character?
+    bool start = true; // right after '#'?
+    while (s < end && *s != '\n') {
+        char* t;
+        if (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\f' || *s == '\v') {
+            space = true;
+            s++;
+            continue;
+        }
+        if (*s == '\\' && s + 1 < end && s[1] == '\n') {
+            space = true;
+            s += 2;
+            continue;
+        }
+        if (is_comment(s, end)) {
+            t = skip_comment(s, end);
+            if (is_open_comment(s, t)) {
+                // the comment takes the rest of the text
+                if (strip_comments) {
+                    s = t;
+                    break;
+                }
+                if (space && !start) xappend_char(out, ' ');
+                xappend_cstring2(out, s, t);
+                return t;
+            }
+            if (strip_comments) {
+                space = true;
+                s = t;
+                continue;
+            }
+        } else if (*s == '"' || *s == '\'') {
+            t = skip_literal(s, end);
+        } else {
+            t = s + 1;
+        }
+        if (space && !start) xappend_char(out, ' ');
+        xappend_cstring2(out, s, t);
+        space = false;
+        start = false;
+        s = t;
+    }
+    xappend_char(out, '\n');
+    return s;
+}
+
+/*
+Appends the canonical form of the header text to out, see canonical_header.
+Returns true if the text ends at a declaration boundary, i.e., at the
+beginning of a line outside of declarations, directives, and comments. The
+canonical form of text that follows such a boundary does not depend on the
+text before it, so the canonical forms of the parts of a header text can be
+concatenated.
+*/
+bool append_canonical_header(String* out, String text, bool strip_comments) {
+    require_not_null(out);
+    char* s = text.s;
+    char* end = text.s + text.len;
+    ptrdiff_t depth = 0; // nesting of parentheses, brackets, and braces
+    bool line_start = true; // is s at the beginning of an input line?
+    bool open = false; // has an open comment or directive taken the rest of the text?
+    char* prev = NULL; // previous token on the output line, NULL if none
+    ptrdiff_t prev_len = 0;
+    char before = '\0'; // last character of the token before prev
+    while (s < end) {
+        char c = *s;
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+            s++;
+        } else if (c == '\n') {
+            line_start = true;
+            s++;
+        } else if (c == '\\' && s + 1 < end && s[1] == '\n') {
+            s += 2;
+        } else if (line_start && c == '#') {
+            if (prev != NULL) xappend_char(out, '\n');
+            s = append_canonical_directive(out, s, end, strip_comments);
+            // a directive without a line break may continue in the following text
+            if (s == end) open = true;
+            prev = NULL;
+        } else if (is_comment(s, end)) {
+            char* t = skip_comment(s, end);
+            line_start = false;
+            if (is_open_comment(s, t)) {
+                // the comment takes the rest of the text
+                open = true;
+                if (!strip_comments) {
+                    if (prev != NULL) xappend_char(out, ' ');
+                    xappend_cstring2(out, s, t);
+                    prev = NULL;
+                }
+            } else if (!strip_comments) {
+                if (prev != NULL) xappend_char(out, ' ');
+                ptrdiff_t n = t - s;
+                while (n > 2 && (s[n - 1] == ' ' || s[n - 1] == '\t' || s[n - 1] == '\r')) n--;
+                xappend_cstring2(out, s, s + n);
+                if (prev == NULL || s[1] == '/') {
+                    // comments outside of declarations and line comments end the line
+                    xappend_char(out, '\n');
+                    prev = NULL;
+                } else {
+                    prev = "/**/";
+                    prev_len = 4;
+                }
+            }
+            s = t;
+        } else {
+            char* t = token_end(s, end);
+            line_start = false;
+            if (prev != NULL && needs_space(before, prev, prev_len, s, t - s)) {
+                xappend_char(out, ' ');
+            }
+            xappend_cstring2(out, s, t);
+            before = prev != NULL ? prev[prev_len - 1] : '\0';
+            prev = s;
+            prev_len = t - s;
+            if (c == '(' || c == '[' || c == '{') depth++;
+            if ((c == ')' || c == ']' || c == '}') && depth > 0) depth--;
+            // an unterminated literal ends at the end of its line
+            if ((c == ';' && depth == 0) || is_open_literal(s, t)) {
+                xappend_char(out, '\n');
+                prev = NULL;
+            }
+            s = t;
+        }
+    }
+    if (prev != NULL) xappend_char(out, '\n');
+    return prev == NULL && depth == 0 && line_start && !open;
+}
+
+/*
+Returns the canonical form of the header text, which only depends on its
+tokens: Each declaration is written on a line of its own, tokens are separated
+by at most a single space, and indentation and line breaks within declarations
+are removed. Preprocessor directives keep their lines. Comments are kept (on
+lines of their own if they are outside of declarations) or, if strip_comments
+is set, removed. Reformatting the source text thus does not change the header
+file, so that dependent files need not be recompiled. A change to the canonical
+form needs a new OUTPUT_VERSION (see output_version_test).
+*/
+String canonical_header(String text, bool strip_comments) {
+    String out = new_string(text.len + 16);
+    append_canonical_header(&out, text, strip_comments);
+    return out;
+}
+
+/*
+Replaces the header file contents by their canonical form. The canonical text
+is stored in text, which has to be freed after the contents have been written.
+*/
+void canonicalize_header(Segments* head, String* text, bool strip_comments) {
+    require_not_null(head);
+    require_not_null(text);
+    String raw = segments_to_string(head);
+    *text = canonical_header(raw, strip_comments);
+    free(raw.s);
+    head->count = 0;
+    head->len = 0;
+    xappend_segment_string(head, *text);
+}
+
+/*
+Checks that the canonical form of the header text s is expected.
+*/
+void test_canonical(char* s, bool strip_comments, char* expected) {
+    String out = canonical_header(make_string(s), strip_comments);
+    test_equal_s(out, expected);
+    free(out.s);
+}
+
+/*
+Checks whether the first k chars of the header text s end at a declaration
+boundary and, if they do, that the canonical forms of both parts make up the
+canonical form of s.
+*/
+void test_canonical_split(char* s, ptrdiff_t k, bool strip_comments, bool boundary) {
+    String text = make_string(s);
+    String expected = canonical_header(text, strip_comments);
+    xappend_char(&expected, '\0');
+    String out = new_string(16);
+    test_equal_i(append_canonical_header(&out, make_string2(s, k), strip_comments), boundary);
+    if (boundary) {
+        append_canonical_header(&out, make_string2(s + k, text.len - k), strip_comments);
+        test_equal_s(out, expected.s);
+    }
+    free(out.s);
+    free(expected.s);
+}
+
+void canonical_header_test(void) {
+    test_canonical("", false, "");
+    test_canonical("int f(void);\n", false, "int f(void);\n");
+    test_canonical("int   f ( int x ,\n      char * p ) ;\n", false, "int f(int x, char* p);\n");
+    test_canonical("char ** g(void (*f)(int*), int a[N * 2]);", false, 
+            "char** g(void(*f)(int*), int a[N* 2]);\n");
+    test_canonical("extern int a[ 10 ] ;\nextern  int b;\n", false, "extern int a[10];\nextern int b;\n");
+    test_canonical("typedef struct P {\n    int x;\n    int y;\n} P;\n", false, 
+            "typedef struct P { int x; int y; } P;\n");
+    test_canonical("enum E {\n  A = 1,\n  B\n};\n", false, "enum E { A = 1, B };\n");
+    // tokens that would run together stay separated
+    test_canonical("int f(int a - - b);", false, "int f(int a- -b);\n");
+    test_canonical("int x / *p;", false, "int x/ * p;\n");
+    test_canonical("char* s = L \"x\" \"y\";", false, "char* s = L \"x\" \"y\";\n");
+    test_canonical("double d = 1.5e+3 . 5;", false, "double d = 1.5e+3 . 5;\n");
+    test_canonical("char*  s = \"a  b\";", false, "char* s = \"a  b\";\n");
+    // directives keep their lines and the space before a macro's parameters
+    test_canonical("#  define  F(x)   ((x) + 1)\n#define G (x)\nint a;", false, 
+            "#define F(x) ((x) + 1)\n#define G (x)\nint a;\n");
+    test_canonical("#define M(a) \\\n    a\nint b;\n", false, "#define M(a) a\nint b;\n");
+    test_canonical("int a\n#ifdef X\n  , b\n#endif\n;\n", false, "int a\n#ifdef X\n, b\n#endif\n;\n");
+    // comments
+    test_canonical("/* doc */   \nint f(void /* none */);  // trailing\n", false, 
+            "/* doc */\nint f(void /* none */);\n// trailing\n");
+    test_canonical("/* doc */\nint f(void /* none */);  // trailing\n", true, "int f(void);\n");
+    test_canonical("#include <a.h> // why\n", true, "#include <a.h>\n");
+    test_canonical("int a, // first\n  b;\n", false, "int a, // first\nb;\n");
+    test_canonical("int a; /* open\n", false, "int a;\n/* open\n");
+    test_canonical("#define A /* open\n", false, "#define A /* open\n");
+    test_canonical("char c = '\n  x;\n", false, "char c = '\nx;\n");
+    // the canonical form is stable
+    test_canonical("int f(int x, char* p);\n", false, "int f(int x, char* p);\n");
+    test_canonical("typedef struct P { int x; int y; } P;\n", false, 
+            "typedef struct P { int x; int y; } P;\n");
+    // parts that end at a declaration boundary are canonicalized alone
+    test_canonical_split("int a;\nint  b;\n", 7, false, true);
+    test_canonical_split("int a; // c\n/* d */\nint b;\n", 12, false, true);
+    test_canonical_split("int a; // c\n/* d */\nint b;\n", 20, true, true);
+    test_canonical_split("#define A 1\nint b;\n", 12, false, true);
+    test_canonical_split("int f(int x,\n      char* p);\n", 13, false, false);
+    test_canonical_split("typedef struct P {\n  int x;\n} P;\n", 19, false, false);
+    test_canonical_split("int a, /* x */\nb;\n", 15, false, false);
+    test_canonical_split("int a;\n/* open\n*/ int b;\n", 15, false, false);
+    test_canonical_split("#define M(a) \\\n  (a)\n", 15, false, false);
+    test_canonical_split("int a;", 6, false, false);
+}
+
+/*
+Version of the outputs in the cache keys and the fingerprints. It has to be
+incremented whenever a change to headify changes the outputs for some source
+text, so that outputs of older versions are neither taken from the cache nor
+pass --check. Builds of the same version share the cache entries.
+output_version_test fails if the outputs change without a new version.
+*/
+#define OUTPUT_VERSION "headify outputs 1"
+
+/*
+Writes 32 hex digits to key that identify the outputs of a source text, given
+the hash of the source text: a hash of the prefix, the base name (which appears
+in the include guard), the options, and the hash of the source text.
+*/
+void make_key(char* prefix, Options* options, String basename, uint64_t source_hash[2], 
+        char key[33]) {
+    require_not_null(prefix);
+    require_not_null(options);
+    size_t n = strlen(prefix) + basename.len + 64;
+    String text = new_string(n);
+    text.len = snprintf(text.s, n, "%s\n%.*s\n%d %d %d\n%016llx%016llx", prefix, 
+            (int)basename.len, basename.s, 
+            options->canonical, options->strip_comments, options->fingerprint, 
+            (unsigned long long)source_hash[0], (unsigned long long)source_hash[1]);
+    uint64_t h[2];
+    hash128(text.s, text.len, 0, h);
+    free(text.s);
+    snprintf(key, 33, "%016llx%016llx", (unsigned long long)h[0], (unsigned long long)h[1]);
+}
+
+/*
+The first line of a header file with a fingerprint, which is followed by 32 hex
+digits and a line break. The fingerprint identifies the source text, the base
+name, the options, and the version of the outputs, so that stale header files
+are detected by hashing the source text, without scanning or parsing it.
+*/
+#define FINGERPRINT_PREFIX "// headify fingerprint "
+#define FINGERPRINT_LENGTH (sizeof(FINGERPRINT_PREFIX) - 1 + 32 + 1)
+
+/*
+Writes the first line of the header file, terminated by '\0', to line, which
+has room for FINGERPRINT_LENGTH + 1 chars.
+*/
+void make_fingerprint(Options* options, String basename, uint64_t source_hash[2], char* line) {
+    require_not_null(options);
+    require_not_null(line);
+    char key[33];
+    make_key("fingerprint\n" OUTPUT_VERSION, options, basename, source_hash, key);
+    snprintf(line, FINGERPRINT_LENGTH + 1, "%s%s\n", FINGERPRINT_PREFIX, key);
+}
+
+/*
+Inserts the line at the beginning of the header file contents. The line is
+referenced, not copied.
+*/
+void prepend_fingerprint(Segments* head, char* line) {
+    require_not_null(head);
+    require_not_null(line);
+    Segments segs = new_segments(head->count + 1);
+    xappend_segment_cstring(&segs, line);
+    xappend_segments(&segs, head);
+    free_segments(head);
+    *head = segs;
+}
+
+/*
+Number of bytes that the streaming mode reads at a time.
+*/
+#ifndef STREAM_BLOCK
+#define STREAM_BLOCK (64 * 1024)
+#endif
+
+/*
+Removes the incomplete outputs and reports the error at the given offset of the
+window. Existing output files stay untouched.
+*/
+void fail_stream(Stream* s, size_t offset, char* message) {
+    close(s->head_fd);
+    close(s->impl_fd);
+    unlink(s->head_temp.s);
+    unlink(s->impl_temp.s);
+    ptrdiff_t line = s->lines + line_of(&s->elements.lines, offset);
+    fprintf(stderr, "%s:%td: %s\n", s->filename, line, message);
+    s->failed = true;
+}
+
+/*
+Appends the line breaks of the window from the given offset on to the line
+table of the stream.
+*/
+void stream_index_lines(Stream* s, size_t offset) {
+    require_not_null(s);
+    LineTable* lines = &s->breaks;
+    char* end = s->window.s + s->window.len;
+    for (char* p = s->window.s + offset; (p = memchr(p, '\n', end - p)) != NULL; p++) {
+        if (lines->count >= lines->cap) {
+            lines->cap = lines->cap < 1024 ? 1024 : 2 * lines->cap;
+            lines->breaks = xrealloc(lines->breaks, lines->cap * sizeof(size_t));
+        }
+        lines->breaks[lines->count++] = p - s->window.s;
+    }
+    s->elements.lines = *lines;
+}
+
+/*
+Reads at least want bytes into the window, unless the end of the input comes
+first or reading fails. Only the line breaks of the new bytes are indexed, so
+a large phrase that takes many reads is not searched for line breaks again
+after every read.
+*/
+void stream_read(Stream* s, size_t want) {
+    require_not_null(s);
+    String* w = &s->window;
+    size_t start = w->len;
+    size_t got = 0;
+    while (got < want && !s->eof) {
+        xreserve(w, want - got + 1);
+        ssize_t n = read(s->fd, w->s + w->len, w->cap - w->len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            fail_stream(s, 0, "Cannot read");
+            break;
+        }
+        if (n == 0) s->eof = true;
+        if (s->options->fingerprint) hasher_update(&s->hasher, w->s + w->len, n);
+        w->len += n;
+        got += n;
+    }
+    w->s[w->len] = '\0';
+    s->elements.source = w->s;
+    stream_index_lines(s, start);
+}
+
+/*
+Scans the complete elements of the window that follow the ones scanned
+before. Unless the input has ended, an element is only complete if at least two
+characters follow it, because the scanner looks ahead by up to two characters
+to decide where an element ends. The scan of an incomplete group continues
+where it stopped, so a large group is not scanned again after every read.
+*/
+void stream_scan(Stream* s) {
+    require_not_null(s);
+    char* end = s->window.s + s->window.len;
+    Arena* arena = &s->arenas[s->current];
+    while (true) {
+        bool indent = s->scanner.indent;
+        Element e = scan_next(&s->scanner, s->window.s + s->scanned);
+        if (e.type == eos || (!s->eof && e.end + 1 >= end)) {
+            // wait for more input, scan this element again, an incomplete
+            // group is resumed from its last checkpoint
+            s->scanner.indent = indent;
+            break;
+        }
+        if (e.type == err) {
+            fail_stream(s, s->scanner.error_pos - s->window.s, s->scanner.error_message);
+            return;
+        }
+        append_element(arena, &s->elements, e);
+        s->scanned = e.end - s->window.s;
+        s->group.valid = false;
+    }
+}
+
+/*
+Appends the complete phrases of the window and the text between them to the
+outputs. Returns the offset after the last complete phrase and sets *next to
+the index of the element that follows it. At the end of the input, everything
+is complete.
+*/
+size_t stream_parse(Stream* s, ptrdiff_t* next) {
+    require_not_null(s);
+    require_not_null(next);
+    ElementTable* table = &s->elements;
+    char* gap = s->window.s;
+    ptrdiff_t e = 0;
+    *next = 0;
+    while (true) {
+        e = skip_whi_lbr_sem(table, e);
+        if (e >= table->count) break;
+        Phrase phrase = get_phrase(table, e);
+        bool complete = phrase.last < table->count;
+        if (!complete && !s->eof) break;
+        if (phrase.type == error) {
+            if (complete) e = phrase.last;
+            fail_stream(s, element_end(table, e) - table->source, "Error");
+            return 0;
+        }
+        xappend_segment(&s->impl, gap, element_begin(table, phrase.first));
+        append_header_phrase(&s->head, table, &phrase);
+        append_impl_phrase(&s->impl, table, &phrase);
+        gap = element_end(table, phrase.last);
+        e = phrase.last + 1;
+        *next = e;
+    }
+    if (s->eof) {
+        // the text after the last phrase
+        char* end = s->window.s + s->window.len;
+        xappend_segment(&s->impl, gap, end);
+        gap = end;
+        *next = table->count;
+    }
+    return gap - s->window.s;
+}
+
+/*
+Replaces the header contents of the stream by their canonical form, which is
+stored in text. The canonical form of the whole header file is that of its
+parts between declaration boundaries. Header text that does not end at such a
+boundary, e.g., within a declaration that continues in the next phrase, is
+kept in pending_head and canonicalized together with the following text.
+*/
+void canonicalize_stream_head(Stream* s, String* text) {
+    require_not_null(s);
+    require_not_null(text);
+    String raw = segments_to_string(&s->head);
+    if (s->pending_head.len > 0) {
+        xappend_string(&s->pending_head, raw);
+        free(raw.s);
+        raw = s->pending_head;
+        s->pending_head = (String){NULL, 0, 0};
+    }
+    s->head.count = 0;
+    s->head.len = 0;
+    *text = new_string(raw.len + 16);
+    if (append_canonical_header(text, raw, s->options->strip_comments) || s->eof) {
+        xappend_segment_string(&s->head, *text);
+        free(raw.s);
+    } else {
+        text->len = 0;
+        s->pending_head = raw;
+    }
+}
+
+/*
+Writes the outputs and removes the source text up to the given offset from the
+window. The elements from index next on are moved to the other arena.
+*/
+void stream_release(Stream* s, size_t offset, ptrdiff_t next) {
+    require_not_null(s);
+    String text = {NULL, 0, 0};
+    if (s->options->canonical) canonicalize_stream_head(s, &text);
+    write_segments_fd(s->head_fd, s->head_temp.s, &s->head);
+    write_segments_fd(s->impl_fd, s->impl_temp.s, &s->impl);
+    free(text.s);
+    s->head.count = 0;
+    s->head.len = 0;
+    s->impl.count = 0;
+    s->impl.len = 0;
+
+    // the line breaks after offset move to the beginning of the window
+    LineTable* lines = &s->breaks;
+    ptrdiff_t k = count_breaks_before(lines, offset);
+    s->lines += k;
+    for (ptrdiff_t i = k; i < lines->count; i++) {
+        lines->breaks[i - k] = lines->breaks[i] - offset;
+    }
+    lines->count -= k;
+
+    ElementTable* old = &s->elements;
+    ptrdiff_t n = old->count - next;
+    Arena* arena = &s->arenas[1 - s->current];
+    arena_reset(arena);
+    ElementTable table = {old->source, 0, 0, NULL, NULL, NULL, NULL};
+    if (n > 0) {
+        reserve_elements(arena, &table, n);
+        memcpy(table.types, old->types + next, n * sizeof(unsigned char));
+        memcpy(table.lengths, old->lengths + next, n * sizeof(size_t));
+        memcpy(table.keywords, old->keywords + next, n * sizeof(unsigned char));
+        for (ptrdiff_t i = 0; i < n; i++) {
+            table.begins[i] = old->begins[next + i] - offset;
+        }
+        table.count = n;
+    }
+    table.lines = *lines;
+    s->elements = table;
+    s->current = 1 - s->current;
+
+    String* w = &s->window;
+    memmove(w->s, w->s + offset, w->len - offset + 1);
+    w->len -= offset;
+    s->scanned -= offset;
+}
+
+/*
+Writes the line of the fingerprint, if any, and replaces the output files with
+the temporary files if their contents differ.
+*/
+void finish_stream(Stream* s, String basename) {
+    require_not_null(s);
+    if (s->options->fingerprint) {
+        uint64_t h[2];
+        hasher_final(&s->hasher, h);
+        char line[FINGERPRINT_LENGTH + 1];
+        make_fingerprint(s->options, basename, h, line);
+        ssize_t n = pwrite(s->head_fd, line, FINGERPRINT_LENGTH, 0);
+        panicf_if(n != FINGERPRINT_LENGTH, "Cannot write data to file %s.", s->head_temp.s);
+    }
+    panicf_if(close(s->head_fd) != 0, "Cannot write data to file %s.", s->head_temp.s);
+    panicf_if(close(s->impl_fd) != 0, "Cannot write data to file %s.", s->impl_temp.s);
+    replace_if_changed(s->head_temp.s, s->head_name);
+    replace_if_changed(s->impl_temp.s, s->impl_name);
+}
+
+/*
+Reads the source text from the file descriptor and writes the header file and
+the implementation file while reading. Phrases are written as soon as they are
+complete, and their text and elements are released. Memory use is thus bounded
+by the largest phrase rather than by the size of the source text. The outputs
+are the same as for a source file. They are written to temporary files, which
+only replace the output files at the end if their contents differ. The line of
+the fingerprint, if any, is written last. Reports the error and returns false
+if the input cannot be read or is malformed, which leaves the output files
+untouched.
+*/
+bool headify_stream(int fd, char* filename, String basename, char* head_name, char* impl_name,
+        Options* options) {
+    require_not_null(filename);
+    require_not_null(head_name);
+    require_not_null(impl_name);
+    Stream s = {0};
+    s.fd = fd;
+    s.filename = filename;
+    s.window = new_string(STREAM_BLOCK + 1);
+    s.arenas[0] = make_arena(64 * 1024);
+    s.arenas[1] = make_arena(64 * 1024);
+    s.elements = (ElementTable){s.window.s, 0, 0, NULL, NULL, NULL, NULL};
+    s.scanner = make_scanner();
+    s.scanner.group = &s.group;
+    s.options = options;
+    s.head_name = head_name;
+    s.impl_name = impl_name;
+    s.head_fd = create_temp_file(head_name, &s.head_temp);
+    s.impl_fd = create_temp_file(impl_name, &s.impl_temp);
+    s.head = new_segments(256);
+    s.impl = new_segments(256);
+    if (options->fingerprint) {
+        // the fingerprint is only known at the end, reserve its line
+        char line[FINGERPRINT_LENGTH + 1];
+        memset(line, ' ', FINGERPRINT_LENGTH);
+        line[FINGERPRINT_LENGTH] = '\0';
+        Segments segs = new_segments(1);
+        xappend_segment_cstring(&segs, line);
+        write_segments_fd(s.head_fd, s.head_temp.s, &segs);
+        free_segments(&segs);
+        hasher_init(&s.hasher, 0);
+    }
+    append_header_prologue(&s.head, basename);
+
+    bool progress = true;
+    while (true) {
+        // read more at once while a large phrase is incomplete, so that its
+        // lines and elements are not indexed and parsed over and over
+        size_t want = STREAM_BLOCK;
+        if (!progress && s.window.len > want) want = s.window.len;
+        stream_read(&s, want);
+        if (s.failed) break;
+        stream_scan(&s);
+        if (s.failed) break;
+        ptrdiff_t next;
+        size_t offset = stream_parse(&s, &next);
+        if (s.failed) break;
+        if (s.eof) xappend_segment_cstring(&s.head, "#endif\n");
+        stream_release(&s, offset, next);
+        progress = offset > 0;
+        if (s.eof) break;
+    }
+
+    if (!s.failed) finish_stream(&s, basename);
+    free(s.head_temp.s);
+    free(s.impl_temp.s);
+    free_segments(&s.head);
+    free_segments(&s.impl);
+    arena_free(&s.arenas[0]);
+    arena_free(&s.arenas[1]);
+    free(s.group.open);
+    free(s.window.s);
+    free(s.breaks.breaks);
+    free(s.pending_head.s);
+    return !s.failed;
+}
+
+/*
+Checks that headifying s from a file descriptor produces the same contents as
+creating the outputs from the complete source text, with a header file in
+canonical form if requested. The stream reads STREAM_BLOCK bytes at a time, so
+the phrases of a longer text span several reads.
+*/
+void test_stream_options(char* s, bool canonical, bool strip_comments) {
+    Arena arena = make_arena(1024);
+    ElementTable elements = get_elements(&arena, "test", s, 1);
+    PhraseTable phrases = get_phrases(&arena, "test", &elements);
+    Segments head = new_segments(16);
+    Segments impl = new_segments(16);
+    create_outputs(make_string("test"), &elements, &phrases, &head, &impl);
+    String canonical_text = {NULL, 0, 0};
+    if (canonical) canonicalize_header(&head, &canonical_text, strip_comments);
+    String expected_head = segments_to_string(&head);
+    String expected_impl = segments_to_string(&impl);
+
+    char dir[] = "/tmp/headify_stream_testXXXXXX";
+    panicf_if(mkdtemp(dir) == NULL, "Cannot create %s", dir);
+    char name[64], head_name[64], impl_name[64];
+    snprintf(name, sizeof(name), "%s/test.h.c", dir);
+    snprintf(head_name, sizeof(head_name), "%s/test.h", dir);
+    snprintf(impl_name, sizeof(impl_name), "%s/test.c", dir);
+    write_file(name, make_string(s));
+    int fd = open(name, O_RDONLY);
+    panicf_if(fd < 0, "Cannot open %s", name);
+    Options options = {canonical, strip_comments, false, NULL};
+    test_equal_i(headify_stream(fd, "test", make_string("test"), head_name, impl_name, 
+            &options), true);
+    close(fd);
+    String actual_head = read_file(head_name);
+    String actual_impl = read_file(impl_name);
+    test_equal_s(actual_head, expected_head.s);
+    test_equal_s(actual_impl, expected_impl.s);
+
+    free(actual_head.s);
+    free(actual_impl.s);
+    free(expected_head.s);
+    free(expected_impl.s);
+    free(canonical_text.s);
+    free_segments(&head);
+    free_segments(&impl);
+    arena_free(&arena);
+    unlink(name);
+    unlink(head_name);
+    unlink(impl_name);
+    rmdir(dir);
+}
+
+void test_stream(char* s) {
+    test_stream_options(s, false, false);
+    test_stream_options(s, true, false);
+    test_stream_options(s, true, true);
+}
+
+void headify_stream_test(void) {
+    test_stream("");
+    test_stream("int a;");
+    test_stream(";;;\n\n;");
+    test_stream("*int a;\nint b = 1;\n*int f(int x) {\n  return x;\n}\n*int g(void);\n");
+    test_stream("#include <stdio.h>\n*typedef struct P {int x; int y;} P;\n"
+            "*struct Q {\n  int z;\n};\n// comment;\n/* comment; */\n*int a[] = {1, 2};\n"
+            "*int main(void) {\n  puts(\"x;\");\n  return 0;\n}\n");
+    // declarations with comments and line breaks that span the end of a read
+    char* decls = "/* doc */\n*int f(int x, // first\n      char  *  p);\n"
+            "*typedef struct P {\n    int x; /* x */\n    int y;\n} P;\n#define M(a) \\\n  (a)\n"
+            "*int g(void);\n";
+    String source = new_string(STREAM_BLOCK + 256);
+    for (ptrdiff_t shift = 1; shift < 128; shift += 7) {
+        source.len = 0;
+        ptrdiff_t n = (ptrdiff_t)STREAM_BLOCK - shift;
+        while (source.len + 7 < n) xappend_cstring(&source, "int p;\n");
+        if (source.len < n) xappend_chars(&source, ' ', n - source.len);
+        xappend_char(&source, '\n');
+        xappend_cstring(&source, decls);
+        xappend_char(&source, '\0');
+        test_stream(source.s);
+    }
+    free(source.s);
+    // header text that ends within a declaration waits for the rest of it
+    Options options = {true, false, false, NULL};
+    Stream s = {0};
+    s.options = &options;
+    s.head = new_segments(4);
+    xappend_segment_cstring(&s.head, "int f(int x,\n");
+    String text;
+    canonicalize_stream_head(&s, &text);
+    test_equal_i(text.len, 0);
+    test_equal_i(s.head.len, 0);
+    free(text.s);
+    xappend_segment_cstring(&s.head, "      char  * p);\n");
+    canonicalize_stream_head(&s, &text);
+    test_equal_s(text, "int f(int x, char* p);\n");
+    test_equal_i(s.pending_head.len, 0);
+    free(text.s);
+    free(s.pending_head.s);
+    free_segments(&s.head);
+}
+
+/*
+Determines the names of the outputs of the source file. A source file
+"dir/name.h.c" has the outputs "dir/name.h" and "dir/name.c", other source
+files "dir/name_headify.h" and "dir/name_headify.c". Returns false if the
+name has no basename. The names are released with free_file_names.
+*/
+bool make_file_names(char* filename, FileNames* names) {
+    require_not_null(filename);
+    require_not_null(names);
+    // separate dirname and basename (without extension) from filename
+    String name = make_string(filename);
+    ptrdiff_t idir = last_index_of_char(name, '/') + 1;
+    String dirname = make_string2(name.s, idir);
+    bool ends_with_hc = ends_with(name, make_string(".h.c"));
+    ptrdiff_t iext = name.len;
+    if (ends_with_hc) iext -= 4;
+    if (iext - idir <= 0) return false;
+    names->basename = make_string2(name.s + idir, iext - idir);
+    if (DEBUG) printf("%.*s, %.*s, %.*s\n", 
+            (int)name.len, name.s, 
+            (int)dirname.len, dirname.s, 
+            (int)names->basename.len, names->basename.s); 
+
+    names->headname = new_string(256);
+    xappend_string(&names->headname, dirname);
+    xappend_string(&names->headname, names->basename);
+    if (ends_with_hc) {
+        xappend_cstring(&names->headname, ".h");
+    } else {
+        xappend_cstring(&names->headname, "_headify.h");
+    }
+    xappend_char(&names->headname, '\0');
+
+    names->implname = new_string(256);
+    xappend_string(&names->implname, dirname);
+    xappend_string(&names->implname, names->basename);
+    if (ends_with_hc) {
+        xappend_cstring(&names->implname, ".c");
+    } else {
+        xappend_cstring(&names->implname, "_headify.c");
+    }
+    xappend_char(&names->implname, '\0');
+    return true;
+}
+
+void free_file_names(FileNames* names) {
+    require_not_null(names);
+    free(names->headname.s);
+    free(names->implname.s);
+}
+
+/*
+Returns an allocated error message for the given line of the source file. Line
+0 denotes the file as a whole.
+*/
+String file_error(char* filename, ptrdiff_t line, char* message) {
+    String error = new_string(strlen(filename) + strlen(message) + 32);
+    if (line > 0) {
+        error.len = snprintf(error.s, error.cap, "%s:%td: %s\n", filename, line, message);
+    } else {
+        error.len = snprintf(error.s, error.cap, "%s: %s\n", filename, message);
+    }
+    return error;
+}
+
+/*
+Checks whether the outputs of the source file are up to date, by comparing the
+first line of the header file with the fingerprint of the source text. Returns
+0 if they are, 1 if the header file has another fingerprint or an output file
+is missing, and 2 if the source file cannot be read. Stores a message in
+message, unless the outputs are up to date.
+*/
+int check_file(char* filename, Options* options, String* message) {
+    require_not_null(filename);
+    require_not_null(options);
+    require_not_null(message);
+    FileNames names;
+    if (!make_file_names(filename, &names)) {
+        *message = file_error(filename, 0, "Not a C file name");
+        return 2;
+    }
+    FileData source;
+    if (!try_load_file(filename, &source)) {
+        *message = file_error(filename, 0, "Cannot open");
+        free_file_names(&names);
+        return 2;
+    }
+    uint64_t h[2];
+    hash128(source.data.s, source.data.len, 0, h);
+    release_file(&source);
+    char expected[FINGERPRINT_LENGTH + 1];
+    make_fingerprint(options, names.basename, h, expected);
+    char actual[FINGERPRINT_LENGTH];
+    ssize_t n = -1;
+    int fd = open(names.headname.s, O_RDONLY);
+    if (fd >= 0) {
+        n = pread(fd, actual, FINGERPRINT_LENGTH, 0);
+        close(fd);
+    }
+    int status = 0;
+    if (n != FINGERPRINT_LENGTH || memcmp(actual, expected, FINGERPRINT_LENGTH) != 0 
+            || access(names.implname.s, F_OK) != 0) {
+        *message = file_error(filename, 0, "Out of date");
+        status = 1;
+    }
+    free_file_names(&names);
+    return status;
+}
+
+void* check_worker(void* arg) {
+    Check* check = arg;
+    while (true) {
+        pthread_mutex_lock(&check->lock);
+        int i = check->next++;
+        pthread_mutex_unlock(&check->lock);
+        if (i >= check->files->count) return NULL;
+        check->status[i] = check_file(check->files->names[i], check->options, check->messages + i);
+    }
+}
+
+/*
+Checks the files with the given number of threads. The messages are printed in
+the order of the files. Returns the largest result of check_file.
+*/
+int check_files(FileList* files, Options* options, int threads) {
+    require_not_null(files);
+    require_not_null(options);
+    Check check = {files, options, NULL, NULL, 0};
+    check.status = xcalloc(files->count > 0 ? files->count : 1, sizeof(int));
+    check.messages = xcalloc(files->count > 0 ? files->count : 1, sizeof(String));
+    pthread_mutex_init(&check.lock, NULL);
+    if (threads > files->count) threads = files->count;
+    if (threads < 1) threads = 1;
+    pthread_t* workers = xcalloc(threads, sizeof(pthread_t));
+    for (int k = 1; k < threads; k++) {
+        int r = pthread_create(workers + k, NULL, check_worker, &check);
+        panicf_if(r != 0, "cannot create worker thread (%d)", r);
+    }
+    check_worker(&check);
+    for (int k = 1; k < threads; k++) {
+        pthread_join(workers[k], NULL);
+    }
+    free(workers);
+    int result = 0;
+    for (int i = 0; i < files->count; i++) {
+        if (check.messages[i].len > 0) {
+            fwrite(check.messages[i].s, 1, check.messages[i].len, stderr);
+        }
+        free(check.messages[i].s);
+        if (check.status[i] > result) result = check.status[i];
+    }
+    pthread_mutex_destroy(&check.lock);
+    free(check.status);
+    free(check.messages);
+    return result;
+}
+
+/*
+Determines the names of the cached outputs of the source text, given its hash.
+The key also depends on the version of the outputs.
+*/
+void make_cache_entry(Options* options, String basename, uint64_t source_hash[2], 
+        CacheEntry* entry) {
+    require_not_null(options);
+    require_not_null(options->cache);
+    require_not_null(entry);
+    char hex[33];
+    make_key(OUTPUT_VERSION, options, basename, source_hash, hex);
+    size_t n = strlen(options->cache) + 64;
+    entry->dir = new_string(n);
+    entry->dir.len = snprintf(entry->dir.s, n, "%s/%.2s", options->cache, hex);
+    entry->headname = new_string(n);
+    entry->headname.len = snprintf(entry->headname.s, n, "%s/%s.h", entry->dir.s, hex + 2);
+    entry->implname = new_string(n);
+    entry->implname.len = snprintf(entry->implname.s, n, "%s/%s.c", entry->dir.s, hex + 2);
+}
+
+void free_cache_entry(CacheEntry* entry) {
+    require_not_null(entry);
+    free(entry->dir.s);
+    free(entry->headname.s);
+    free(entry->implname.s);
+    *entry = (CacheEntry){{NULL, 0, 0}, {NULL, 0, 0}, {NULL, 0, 0}};
+}
+
+/*
+Copies the cached outputs to the output files, if both are in the cache.
+Unchanged output files keep their modification time. Returns false on a cache
+miss.
+*/
+bool fetch_cached_outputs(CacheEntry* entry, FileNames* names) {
+    require_not_null(entry);
+    require_not_null(names);
+    return copy_file_if_changed(entry->headname.s, names->headname.s)
+        && copy_file_if_changed(entry->implname.s, names->implname.s);
+}
+
+/*
+Creates the directories of the cache entry. Returns false if the cache cannot
+be written, in which case the outputs are not stored.
+*/
+bool prepare_cache_entry(char* cache, CacheEntry* entry) {
+    require_not_null(cache);
+    require_not_null(entry);
+    if (mkdir(cache, 0777) != 0 && errno != EEXIST) return false;
+    if (mkdir(entry->dir.s, 0777) != 0 && errno != EEXIST) return false;
+    return access(entry->dir.s, W_OK) == 0;
+}
+
+/*
+Stores the outputs in the cache. Each file is written to a temporary file and
+renamed, so that concurrent runs of headify that share the cache never see
+partial entries. Since the names depend on the contents, concurrent runs that
+store the same entry write the same contents.
+*/
+void store_cached_outputs(char* cache, CacheEntry* entry, Segments* head, Segments* impl) {
+    require_not_null(entry);
+    require_not_null(head);
+    require_not_null(impl);
+    if (!prepare_cache_entry(cache, entry)) return;
+    write_segments_if_changed(entry->implname.s, impl);
+    write_segments_if_changed(entry->headname.s, head);
+}
+
+/*
+Limits of the batch pipeline: the number of reads or writes in flight per I/O
+ring, the number of jobs that the writer compares and writes at once, the
+capacity of the queues between the stages, and the number of bytes of source
+text in memory at a time (unless a single file is larger).
+*/
+#define BATCH_RING_SIZE 64
+#define BATCH_WRITE_JOBS 16
+#define BATCH_QUEUE_SIZE 256
+#define BATCH_MEMORY ((size_t)256 << 20)
+
+void job_queue_init(JobQueue* q, int cap) {
+    require_not_null(q);
+    require("positive", cap > 0);
+    q->a = xcalloc(cap, sizeof(Job*));
+    q->cap = cap;
+    q->first = 0;
+    q->count = 0;
+    q->closed = false;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->changed, NULL);
+}
+
+void job_queue_free(JobQueue* q) {
+    require_not_null(q);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->changed);
+    free(q->a);
+}
+
+/*
+Appends the job to the queue. Waits while the queue is full.
+*/
+void job_queue_push(JobQueue* q, Job* job) {
+    require_not_null(q);
+    require_not_null(job);
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->cap) pthread_cond_wait(&q->changed, &q->lock);
+    q->a[(q->first + q->count) % q->cap] = job;
+    q->count++;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+Removes up to max jobs from the queue and stores them in jobs. Waits while the
+queue is empty and open. Returns the number of jobs removed, 0 if the queue is
+empty and closed.
+*/
+int job_queue_pop_many(JobQueue* q, Job** jobs, int max) {
+    require_not_null(q);
+    require_not_null(jobs);
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed) pthread_cond_wait(&q->changed, &q->lock);
+    int n = 0;
+    while (n < max && q->count > 0) {
+        jobs[n++] = q->a[q->first];
+        q->first = (q->first + 1) % q->cap;
+        q->count--;
+    }
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+/*
+Removes the oldest job from the queue. Waits while the queue is empty and open.
+Returns NULL if the queue is empty and closed.
+*/
+Job* job_queue_pop(JobQueue* q) {
+    Job* job;
+    return job_queue_pop_many(q, &job, 1) > 0 ? job : NULL;
+}
+
+/*
+Signals that no more jobs will be pushed.
+*/
+void job_queue_close(JobQueue* q) {
+    require_not_null(q);
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+Accounts for the source text of a job that is about to be read. Returns false
+if this would exceed BATCH_MEMORY, unless wait is set, in which case it waits
+until enough source text has been released. A job is always admitted if no
+source text is in memory.
+*/
+bool reserve_memory(Batch* batch, size_t size, bool wait) {
+    pthread_mutex_lock(&batch->lock);
+    while (batch->memory > 0 && batch->memory + size > BATCH_MEMORY) {
+        if (!wait) {
+            pthread_mutex_unlock(&batch->lock);
+            return false;
+        }
+        pthread_cond_wait(&batch->released, &batch->lock);
+    }
+    batch->memory += size;
+    pthread_mutex_unlock(&batch->lock);
+    return true;
+}
+
+/*
+Releases the memory of the job that is no longer needed after it has left the
+pipeline. The error message is kept.
+*/
+void release_job(Batch* batch, Job* job) {
+    free(job->source.s);
+    job->source = (String){NULL, 0, 0};
+    arena_free(&job->arena);
+    free_segments(&job->head);
+    free_segments(&job->impl);
+    free(job->canonical.s);
+    free_file_names(&job->names);
+    free_cache_entry(&job->cached);
+    pthread_mutex_lock(&batch->lock);
+    batch->memory -= job->size;
+    pthread_cond_broadcast(&batch->released);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+// Orders jobs by decreasing size, equally large ones in the order given.
+int compare_jobs(const void* a, const void* b) {
+    Job* x = *(Job**)a;
+    Job* y = *(Job**)b;
+    if (x->size != y->size) return x->size > y->size ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+/*
+Opens the source file of the job and, unless it is empty, starts reading it.
+Files that are not regular files are read synchronously. Returns false if the
+job failed.
+*/
+bool start_job(Batch* batch, IoRing* ring, Job* job) {
+    if (!make_file_names(job->filename, &job->names)) {
+        job->error = file_error(job->filename, 0, "Not a C file name");
+        return false;
+    }
+    job->fd = open(job->filename, O_RDONLY);
+    struct stat st;
+    if (job->fd < 0 || fstat(job->fd, &st) != 0 || S_ISDIR(st.st_mode)) {
+        if (job->fd >= 0) close(job->fd);
+        job->error = file_error(job->filename, 0, "Cannot open");
+        return false;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        close(job->fd);
+        FileData file;
+        if (!try_load_file(job->filename, &file)) {
+            job->error = file_error(job->filename, 0, "Cannot open");
+            return false;
+        }
+        job->source = file.data; // read, not mapped
+        job_queue_push(&batch->loaded, job);
+        return true;
+    }
+    job->source = new_string(st.st_size + 1);
+    if (st.st_size == 0) {
+        close(job->fd);
+        job->source.s[0] = '\0';
+        job_queue_push(&batch->loaded, job);
+        return true;
+    }
+    io_read(ring, job->fd, job->source.s, st.st_size, 0, job - batch->jobs);
+    return true;
+}
+
+/*
+The first stage of the batch pipeline. Reads the source files, largest first,
+with up to BATCH_RING_SIZE reads in flight, and passes them on to the workers.
+Starts no further reads while the source text in memory would exceed
+BATCH_MEMORY.
+*/
+void* batch_reader(void* arg) {
+    Batch* batch = arg;
+    Job** sorted = xcalloc(batch->count > 0 ? batch->count : 1, sizeof(Job*));
+    for (int i = 0; i < batch->count; i++) sorted[i] = batch->jobs + i;
+    qsort(sorted, batch->count, sizeof(Job*), compare_jobs);
+    IoRing ring;
+    io_ring_init(&ring, BATCH_RING_SIZE, batch->synchronous);
+    IoCompletion done[BATCH_RING_SIZE];
+    int next = 0;
+    while (next < batch->count || ring.inflight > 0) {
+        while (next < batch->count && !io_ring_full(&ring)) {
+            Job* job = sorted[next];
+            // only wait for memory if no reads are in flight
+            if (!reserve_memory(batch, job->size, ring.inflight == 0)) break;
+            next++;
+            if (!start_job(batch, &ring, job)) release_job(batch, job);
+        }
+        int n = io_wait(&ring, done, BATCH_RING_SIZE);
+        for (int i = 0; i < n; i++) {
+            Job* job = batch->jobs + done[i].tag;
+            if (done[i].result < 0) {
+                close(job->fd);
+                job->error = file_error(job->filename, 0, "Cannot read");
+                release_job(batch, job);
+                continue;
+            }
+            size_t size = job->source.cap - 1;
+            job->source.len += done[i].result;
+            if (done[i].result > 0 && job->source.len < size) {
+                // read the rest
+                io_read(&ring, job->fd, job->source.s + job->source.len, 
+                        size - job->source.len, job->source.len, done[i].tag);
+                continue;
+            }
+            close(job->fd);
+            job->source.s[job->source.len] = '\0';
+            job_queue_push(&batch->loaded, job);
+        }
+    }
+    io_ring_free(&ring);
+    free(sorted);
+    job_queue_close(&batch->loaded);
+    return NULL;
+}
+
+/*
+Creates the outputs of the job. Returns false and stores an error message in
+the job if the source text is malformed.
+*/
+bool parse_job(Job* job, Options* options) {
+    char* source_code = job->source.s;
+    job->arena = make_arena(64 * 1024);
+    ElementTable elements = {source_code, 0, 0, NULL, NULL, NULL, NULL};
+    elements.lines = get_lines(&job->arena, source_code);
+    Scanner scanner = make_block_scanner(source_code);
+    if (!try_scan_rest(&job->arena, &elements, &scanner, 0)) {
+        ptrdiff_t line = line_of(&elements.lines, scanner.error_pos - source_code);
+        job->error = file_error(job->filename, line, scanner.error_message);
+        return false;
+    }
+    PhraseTable phrases = {0, 0, NULL};
+    ptrdiff_t e = append_phrases(&job->arena, &elements, 0, elements.count, &phrases);
+    if (e >= 0) {
+        ptrdiff_t line = line_of(&elements.lines, element_end(&elements, e) - source_code);
+        job->error = file_error(job->filename, line, "Error");
+        return false;
+    }
+    job->head = new_segments(1024);
+    job->impl = new_segments(1024);
+    create_outputs(job->names.basename, &elements, &phrases, &job->head, &job->impl);
+    if (options->canonical) {
+        canonicalize_header(&job->head, &job->canonical, options->strip_comments);
+    }
+    if (options->fingerprint) prepend_fingerprint(&job->head, job->fingerprint);
+    return true;
+}
+
+/*
+The second stage of the batch pipeline. Takes the outputs from the cache or
+parses the source files and creates the outputs. Runs on several threads.
+*/
+void* batch_worker(void* arg) {
+    Batch* batch = arg;
+    Options* options = batch->options;
+    Job* job;
+    while ((job = job_queue_pop(&batch->loaded)) != NULL) {
+        uint64_t h[2];
+        if (options->cache != NULL || options->fingerprint) {
+            hash128(job->source.s, job->source.len, 0, h);
+        }
+        if (options->fingerprint) {
+            make_fingerprint(options, job->names.basename, h, job->fingerprint);
+        }
+        if (options->cache != NULL) {
+            make_cache_entry(options, job->names.basename, h, &job->cached);
+            if (fetch_cached_outputs(&job->cached, &job->names)) {
+                release_job(batch, job);
+                continue;
+            }
+        }
+        if (parse_job(job, options)) {
+            job_queue_push(&batch->parsed, job);
+        } else {
+            release_job(batch, job);
+        }
+    }
+    return NULL;
+}
+
+/*
+Reads the existing output files that have the same size as the new outputs,
+with several reads in flight, and determines which outputs changed.
+*/
+void compare_outputs(IoRing* ring, Output* outputs, int n) {
+    IoCompletion done[BATCH_RING_SIZE];
+    for (int k = 0; k < n; k++) {
+        Output* o = outputs + k;
+        o->changed = true;
+        o->existing = NULL;
+        o->done = 0;
+        o->fd = open(o->name, O_RDONLY);
+        if (o->fd < 0) continue;
+        struct stat st;
+        if (fstat(o->fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size == o->segs->len) {
+            if (o->segs->len == 0) {
+                o->changed = false;
+            } else {
+                o->existing = xmalloc(o->segs->len);
+                continue;
+            }
+        }
+        close(o->fd);
+    }
+    int k = 0;
+    while (k < n || ring->inflight > 0) {
+        for (; k < n && !io_ring_full(ring); k++) {
+            Output* o = outputs + k;
+            if (o->existing != NULL) io_read(ring, o->fd, o->existing, o->segs->len, 0, k);
+        }
+        int m = io_wait(ring, done, BATCH_RING_SIZE);
+        for (int i = 0; i < m; i++) {
+            Output* o = outputs + done[i].tag;
+            if (done[i].result > 0) {
+                o->done += done[i].result;
+                if (o->done < o->segs->len) {
+                    io_read(ring, o->fd, o->existing + o->done, o->segs->len - o->done, 
+                            o->done, done[i].tag);
+                    continue;
+                }
+                o->changed = !segments_equal(o->segs, o->existing);
+            }
+            close(o->fd);
+            free(o->existing);
+            o->existing = NULL;
+        }
+    }
+}
+
+/*
+Writes the rest of a chunk of which only the given number of bytes have been
+written.
+*/
+void finish_chunk(Output* o, OutputChunk* c, size_t written) {
+    struct iovec* iov = o->iov + c->first;
+    int64_t offset = c->offset;
+    for (ptrdiff_t i = 0; i < c->count; i++) {
+        char* s = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        size_t skip = written < len ? written : len;
+        written -= skip;
+        offset += skip;
+        s += skip;
+        len -= skip;
+        while (len > 0) {
+            ssize_t r = pwrite(o->fd, s, len, offset);
+            if (r < 0 && errno == EINTR) continue;
+            panicf_if(r <= 0, "Cannot write data to file %s.", o->temp.s);
+            s += r;
+            len -= r;
+            offset += r;
+        }
+    }
+}
+
+/*
+Writes the changed outputs to temporary files, with several writes in flight,
+and renames the temporary files to the output files. Each write covers up to
+IOV_MAX segments.
+*/
+void write_outputs(IoRing* ring, Output* outputs, int n) {
+    IoCompletion done[BATCH_RING_SIZE];
+    ptrdiff_t chunk_count = 0;
+    for (int k = 0; k < n; k++) {
+        Output* o = outputs + k;
+        if (o->changed) chunk_count += (o->segs->count + IOV_MAX - 1) / IOV_MAX;
+    }
+    OutputChunk* chunks = xcalloc(chunk_count > 0 ? chunk_count : 1, sizeof(OutputChunk));
+    ptrdiff_t c = 0;
+    for (int k = 0; k < n; k++) {
+        Output* o = outputs + k;
+        if (!o->changed) continue;
+        o->fd = create_temp_file(o->name, &o->temp);
+        o->iov = xcalloc(o->segs->count > 0 ? o->segs->count : 1, sizeof(struct iovec));
+        int64_t offset = 0;
+        for (ptrdiff_t i = 0; i < o->segs->count; i++) {
+            o->iov[i] = (struct iovec){o->segs->a[i].s, o->segs->a[i].len};
+            if (i % IOV_MAX == 0) {
+                chunks[c++] = (OutputChunk){k, i, 0, offset, 0};
+            }
+            OutputChunk* chunk = chunks + c - 1;
+            chunk->count++;
+            chunk->len += o->segs->a[i].len;
+            offset += o->segs->a[i].len;
+        }
+    }
+    ptrdiff_t next = 0;
+    while (next < chunk_count || ring->inflight > 0) {
+        for (; next < chunk_count && !io_ring_full(ring); next++) {
+            OutputChunk* chunk = chunks + next;
+            Output* o = outputs + chunk->output;
+            io_writev(ring, o->fd, o->iov + chunk->first, chunk->count, chunk->offset, next);
+        }
+        int m = io_wait(ring, done, BATCH_RING_SIZE);
+        for (int i = 0; i < m; i++) {
+            OutputChunk* chunk = chunks + done[i].tag;
+            Output* o = outputs + chunk->output;
+            panicf_if(done[i].result < 0, "Cannot write data to file %s.", o->temp.s);
+            if ((size_t)done[i].result < chunk->len) finish_chunk(o, chunk, done[i].result);
+        }
+    }
+    free(chunks);
+    for (int k = 0; k < n; k++) {
+        Output* o = outputs + k;
+        if (!o->changed) continue;
+        if (close(o->fd) != 0) {
+            unlink(o->temp.s);
+            panicf("Cannot write data to file %s.", o->temp.s);
+        }
+        if (rename(o->temp.s, o->name) != 0) {
+            unlink(o->temp.s);
+            panicf("Cannot rename %s to %s", o->temp.s, o->name);
+        }
+        free(o->temp.s);
+        free(o->iov);
+    }
+}
+
+/*
+The last stage of the batch pipeline. Takes up to BATCH_WRITE_JOBS jobs at a
+time, compares their outputs with the existing files, writes the outputs that
+changed, and releases the jobs. The outputs are also stored in the cache, if
+any.
+*/
+void* batch_writer(void* arg) {
+    Batch* batch = arg;
+    IoRing ring;
+    io_ring_init(&ring, BATCH_RING_SIZE, batch->synchronous);
+    Job* jobs[BATCH_WRITE_JOBS];
+    Output outputs[4 * BATCH_WRITE_JOBS];
+    char* cache = batch->options->cache;
+    int n;
+    while ((n = job_queue_pop_many(&batch->parsed, jobs, BATCH_WRITE_JOBS)) > 0) {
+        int m = 0;
+        for (int i = 0; i < n; i++) {
+            Job* job = jobs[i];
+            outputs[m++] = (Output){job->names.headname.s, &job->head};
+            outputs[m++] = (Output){job->names.implname.s, &job->impl};
+            if (cache != NULL && prepare_cache_entry(cache, &job->cached)) {
+                outputs[m++] = (Output){job->cached.implname.s, &job->impl};
+                outputs[m++] = (Output){job->cached.headname.s, &job->head};
+            }
+        }
+        compare_outputs(&ring, outputs, m);
+        write_outputs(&ring, outputs, m);
+        for (int i = 0; i < n; i++) {
+            release_job(batch, jobs[i]);
+        }
+    }
+    io_ring_free(&ring);
+    return NULL;
+}
+
+/*
+Headifies the source files in a pipeline of three stages, so that file I/O
+overlaps with parsing: A reader thread reads the source files, largest first,
+the given number of worker threads parse them, and a writer thread writes the
+outputs that changed. Reads and writes are submitted in batches through
+io_uring, unless it is unavailable or synchronous is set. The stages are
+connected by bounded queues, and the source text in memory is limited to
+BATCH_MEMORY. The error messages are printed in the order of the files,
+independently of the order in which the files were processed. Returns the
+number of files that could not be processed.
+*/
+int headify_batch(FileList* files, Options* options, int threads, bool synchronous) {
+    require_not_null(files);
+    require_not_null(options);
+    int count = files->count;
+    Batch batch = {0};
+    batch.jobs = xcalloc(count > 0 ? count : 1, sizeof(Job));
+    batch.count = count;
+    batch.options = options;
+    batch.synchronous = synchronous;
+    for (int i = 0; i < count; i++) {
+        Job* job = batch.jobs + i;
+        job->filename = files->names[i];
+        job->fd = -1;
+        struct stat st;
+        if (stat(job->filename, &st) == 0) job->size = st.st_size;
+    }
+    job_queue_init(&batch.loaded, BATCH_QUEUE_SIZE);
+    job_queue_init(&batch.parsed, BATCH_QUEUE_SIZE);
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.released, NULL);
+
+    if (threads > count) threads = count;
+    if (threads < 1) threads = 1;
+    pthread_t reader, writer;
+    pthread_t* workers = xcalloc(threads, sizeof(pthread_t));
+    int r = pthread_create(&reader, NULL, batch_reader, &batch);
+    panicf_if(r != 0, "cannot create reader thread (%d)", r);
+    r = pthread_create(&writer, NULL, batch_writer, &batch);
+    panicf_if(r != 0, "cannot create writer thread (%d)", r);
+    for (int k = 1; k < threads; k++) {
+        r = pthread_create(workers + k, NULL, batch_worker, &batch);
+        panicf_if(r != 0, "cannot create worker thread (%d)", r);
+    }
+    batch_worker(&batch);
+    for (int k = 1; k < threads; k++) {
+        pthread_join(workers[k], NULL);
+    }
+    pthread_join(reader, NULL);
+    job_queue_close(&batch.parsed);
+    pthread_join(writer, NULL);
+    free(workers);
+
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        Job* job = batch.jobs + i;
+        if (job->error.len > 0) {
+            fwrite(job->error.s, 1, job->error.len, stderr);
+            failed++;
+        }
+        free(job->error.s);
+    }
+    job_queue_free(&batch.loaded);
+    job_queue_free(&batch.parsed);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.released);
+    free(batch.jobs);
+    return failed;
+}
+
+/*
+Appends a copy of the file name to the list.
+*/
+void append_file_name(FileList* files, char* s, size_t n) {
+    require_not_null(files);
+    if (files->count >= files->cap) {
+        files->cap = files->cap < 16 ? 16 : 2 * files->cap;
+        files->names = xrealloc(files->names, files->cap * sizeof(char*));
+    }
+    char* name = xmalloc(n + 1);
+    memcpy(name, s, n);
+    name[n] = '\0';
+    files->names[files->count++] = name;
+}
+
+/*
+Appends the file names in the list file to the list. The list file is read
+from stdin if its name is "-". The names are separated by '\0' if the list
+contains one, e.g., if it was produced by "find -print0" or "git ls-files -z",
+and by line breaks otherwise. Empty names are skipped. Reports the error and
+returns false if the list file cannot be read.
+*/
+bool read_file_list(FileList* files, char* listname) {
+    require_not_null(files);
+    require_not_null(listname);
+    FileData list;
+    if (!try_load_file(strcmp(listname, "-") == 0 ? "/dev/stdin" : listname, &list)) {
+        fprintf(stderr, "%s: Cannot open\n", listname);
+        return false;
+    }
+    char* s = list.data.s;
+    char* end = s + list.data.len;
+    char sep = memchr(s, '\0', end - s) != NULL ? '\0' : '\n';
+    while (s < end) {
+        char* t = memchr(s, sep, end - s);
+        if (t == NULL) t = end;
+        size_t n = t - s;
+        if (sep == '\n' && n > 0 && s[n - 1] == '\r') n--;
+        if (n > 0) append_file_name(files, s, n);
+        s = t + 1;
+    }
+    release_file(&list);
+    return true;
+}
+
+void free_file_list(FileList* files) {
+    require_not_null(files);
+    for (int i = 0; i < files->count; i++) free(files->names[i]);
+    free(files->names);
+    *files = (FileList){0, 0, NULL};
+}
+
+/*
+Writes the sources to files in a temporary directory, headifies them as a batch
+with the given number of threads, with or without io_uring, and checks the
+outputs against those of the single file mode. Files are named by their
+position. Files with a NULL source are not created.
+*/
+void test_batch(char** sources, int count, int threads, bool synchronous, int expected_failures) {
+    char dir[] = "/tmp/headify_batch_testXXXXXX";
+    panicf_if(mkdtemp(dir) == NULL, "Cannot create %s", dir);
+    FileList files = {0, 0, NULL};
+    char name[64];
+    for (int i = 0; i < count; i++) {
+        int n = snprintf(name, sizeof(name), "%s/f%d.h.c", dir, i);
+        if (sources[i] != NULL) {
+            write_file(name, make_string(sources[i]));
+        }
+        append_file_name(&files, name, n);
+    }
+    Options options = {false, false, false, NULL};
+    test_equal_i(headify_batch(&files, &options, threads, synchronous), expected_failures);
+    for (int i = 0; i < count; i++) {
+        if (sources[i] == NULL) continue;
+        Arena arena = make_arena(1024);
+        ElementTable elements = {sources[i], 0, 0, NULL, NULL, NULL, NULL};
+        elements.lines = get_lines(&arena, sources[i]);
+        Scanner scanner = make_scanner();
+        PhraseTable phrases = {0, 0, NULL};
+        bool ok = try_scan_rest(&arena, &elements, &scanner, 0) 
+            && append_phrases(&arena, &elements, 0, elements.count, &phrases) < 0;
+        snprintf(name, sizeof(name), "%s/f%d.h", dir, i);
+        test_equal_i(access(name, F_OK) == 0, ok);
+        if (ok) {
+            Segments head = new_segments(16);
+            Segments impl = new_segments(16);
+            snprintf(name, sizeof(name), "f%d", i);
+            create_outputs(make_string(name), &elements, &phrases, &head, &impl);
+            String expected_head = segments_to_string(&head);
+            String expected_impl = segments_to_string(&impl);
+            snprintf(name, sizeof(name), "%s/f%d.h", dir, i);
+            String actual = read_file(name);
+            test_equal_s(actual, expected_head.s);
+            free(actual.s);
+            unlink(name);
+            snprintf(name, sizeof(name), "%s/f%d.c", dir, i);
+            actual = read_file(name);
+            test_equal_s(actual, expected_impl.s);
+            free(actual.s);
+            unlink(name);
+            free(expected_head.s);
+            free(expected_impl.s);
+            free_segments(&head);
+            free_segments(&impl);
+        }
+        arena_free(&arena);
+        snprintf(name, sizeof(name), "%s/f%d.h.c", dir, i);
+        unlink(name);
+    }
+    free_file_list(&files);
+    rmdir(dir);
+}
+
+void headify_batch_test(void) {
+    char* sources[] = {
+        "*int a;\nint b = 1;\n*int f(int x) {\n  return x;\n}\n",
+        "",
+        "int f( {\n", // unterminated braces
+        "#include <stdio.h>\n*typedef struct P {int x; int y;} P;\n*int main(void) {\n  return 0;\n}\n",
+        NULL, // does not exist
+        "int b;\nint a[3] b;\n*int c;\n", // erroneous phrase
+        "*struct Q {\n  int z;\n};\n// comment;\n/* comment; */\n*int a[] = {1, 2};\n",
+    };
+    int count = sizeof(sources) / sizeof(sources[0]);
+    for (int threads = 1; threads <= 4; threads++) {
+        test_batch(sources, count, threads, false, 3);
+        test_batch(sources, count, threads, true, 3);
+    }
+    test_batch(sources, 0, 2, false, 0);
+}
+
+/*
+Headifies a source file as a batch with a cache directory, checks that the
+outputs are stored in the cache, and that they are taken from the cache as long
+as the source text and the options do not change.
+*/
+/*
+Hash of the outputs of the sample of output_version_test for the current
+OUTPUT_VERSION.
+*/
+#define OUTPUT_SAMPLE_HASH "ad21c1d4ad81c4eb3b56cb059ddc8513"
+
+/*
+Checks that the outputs of a sample that has each kind of entity are the ones
+of the current OUTPUT_VERSION. If a change to headify changes them, the test
+fails until OUTPUT_VERSION is incremented and OUTPUT_SAMPLE_HASH is updated,
+so that cached outputs and fingerprints of older versions become invalid.
+*/
+void output_version_test(void) {
+    char* sample = "/* sample */\n#include <stdio.h>\n"
+        "*int f(int a, int b) {\n    return a + b; // sum\n}\n"
+        "int g(void) { return 1; }\n*int h(int a);\nint k(int a);\n"
+        "*int x = 1;\n*int y[2][3] = {\n    {1, 2, 3},\n    {4, 5, 6}\n};\n"
+        "int z = 2;\n*int* p;\nint* q;\n"
+        "*struct S {\n    int  a; /* a */\n    char* b;\n};\nstruct T { int c; };\n"
+        "*typedef struct S S;\ntypedef int I;\n*enum E { e1, e2 };\nenum F { f1 };\n"
+        "*union U { int a; float b; };\n#define M(x) \\\n    ((x) + 1)\n"
+        "int main(void) {\n    return 0;\n}\n";
+    Arena arena = make_arena(1024);
+    ElementTable elements = get_elements(&arena, "sample", sample, 1);
+    PhraseTable phrases = get_phrases(&arena, "sample", &elements);
+    Segments head = new_segments(64);
+    Segments impl = new_segments(64);
+    create_outputs(make_string("sample"), &elements, &phrases, &head, &impl);
+    String head_text = segments_to_string(&head);
+    String outputs = segments_to_string(&impl);
+    xappend_string(&outputs, head_text);
+    for (int strip = 0; strip <= 1; strip++) {
+        String text = canonical_header(head_text, strip);
+        xappend_string(&outputs, text);
+        free(text.s);
+    }
+    free(head_text.s);
+    uint64_t h[2];
+    hash128(outputs.s, outputs.len, 0, h);
+    char hex[33];
+    snprintf(hex, sizeof(hex), "%016llx%016llx", (unsigned long long)h[0], 
+            (unsigned long long)h[1]);
+    if (!test_equal_s(make_string(hex), OUTPUT_SAMPLE_HASH)) {
+        printf("The outputs changed: increment OUTPUT_VERSION and set "
+                "OUTPUT_SAMPLE_HASH to %s\n", hex);
+    }
+    free(outputs.s);
+    free_segments(&head);
+    free_segments(&impl);
+    arena_free(&arena);
+}
+
+void cache_test(void) {
+    char dir[] = "/tmp/headify_cache_testXXXXXX";
+    panicf_if(mkdtemp(dir) == NULL, "Cannot create %s", dir);
+    char cache[64], name[64], head[64], impl[64];
+    snprintf(cache, sizeof(cache), "%s/cache", dir);
+    int n = snprintf(name, sizeof(name), "%s/a.h.c", dir);
+    snprintf(head, sizeof(head), "%s/a.h", dir);
+    snprintf(impl, sizeof(impl), "%s/a.c", dir);
+    String source = make_string("*int f(void) {\n  return 1;\n}\nint g;\n");
+    write_file(name, source);
+    FileList files = {0, 0, NULL};
+    append_file_name(&files, name, n);
+    Options options = {false, false, false, cache};
+    uint64_t h[2], g[2];
+    hash128(source.s, source.len, 0, h);
+    CacheEntry entry;
+    make_cache_entry(&options, make_string("a"), h, &entry);
+    // a miss creates the outputs and stores them in the cache
+    test_equal_i(headify_batch(&files, &options, 1, false), 0);
+    test_equal_i(files_equal(entry.headname.s, head), true);
+    test_equal_i(files_equal(entry.implname.s, impl), true);
+    // a hit copies the cached outputs
+    unlink(head);
+    unlink(impl);
+    write_file(entry.headname.s, make_string("cached\n"));
+    test_equal_i(headify_batch(&files, &options, 2, true), 0);
+    String actual = read_file(head);
+    test_equal_s(actual, "cached\n");
+    free(actual.s);
+    test_equal_i(files_equal(entry.implname.s, impl), true);
+    // a missing part of an entry is a miss
+    unlink(entry.implname.s);
+    test_equal_i(headify_batch(&files, &options, 1, false), 0);
+    test_equal_i(files_equal(entry.implname.s, impl), true);
+    // other options, base names, and source texts have other entries
+    CacheEntry other;
+    options.canonical = true;
+    make_cache_entry(&options, make_string("a"), h, &other);
+    test_equal_i(strcmp(entry.headname.s, other.headname.s) != 0, true);
+    free_cache_entry(&other);
+    options.canonical = false;
+    make_cache_entry(&options, make_string("b"), h, &other);
+    test_equal_i(strcmp(entry.headname.s, other.headname.s) != 0, true);
+    free_cache_entry(&other);
+    hash128("int g;\n", 7, 0, g);
+    make_cache_entry(&options, make_string("a"), g, &other);
+    test_equal_i(strcmp(entry.headname.s, other.headname.s) != 0, true);
+    free_cache_entry(&other);
+    unlink(entry.headname.s);
+    unlink(entry.implname.s);
+    rmdir(entry.dir.s);
+    rmdir(cache);
+    free_cache_entry(&entry);
+    free_file_list(&files);
+    unlink(name);
+    unlink(head);
+    unlink(impl);
+    rmdir(dir);
+}
+
+/*
+Headifies a source file with a fingerprint, as a batch and from a pipe, and
+checks that the outputs are up to date until the source text or the options
+change.
+*/
+void fingerprint_test(void) {
+    char dir[] = "/tmp/headify_fingerprint_testXXXXXX";
+    panicf_if(mkdtemp(dir) == NULL, "Cannot create %s", dir);
+    char name[64], head[64], impl[64], piped_head[64], piped_impl[64];
+    int n = snprintf(name, sizeof(name), "%s/a.h.c", dir);
+    snprintf(head, sizeof(head), "%s/a.h", dir);
+    snprintf(impl, sizeof(impl), "%s/a.c", dir);
+    snprintf(piped_head, sizeof(piped_head), "%s/b.h", dir);
+    snprintf(piped_impl, sizeof(piped_impl), "%s/b.c", dir);
+    char* source = "// comment\n*int f(void) {\n  return 1;\n}\nint g;\n";
+    write_file(name, make_string(source));
+    FileList files = {0, 0, NULL};
+    append_file_name(&files, name, n);
+    Options options = {true, true, true, NULL};
+    String message = {NULL, 0, 0};
+    test_equal_i(check_file(name, &options, &message), 1);
+    free(message.s);
+    test_equal_i(headify_batch(&files, &options, 1, false), 0);
+    String actual = read_file(head);
+    test_equal_i(strncmp(actual.s, FINGERPRINT_PREFIX, strlen(FINGERPRINT_PREFIX)), 0);
+    test_equal_i(actual.s[FINGERPRINT_LENGTH - 1], '\n');
+    // comments are stripped, but not the fingerprint
+    test_equal_i(strstr(actual.s, "comment") == NULL, true);
+    test_equal_i(check_file(name, &options, &message), 0);
+    test_equal_i(check_files(&files, &options, 2), 0);
+    // the streaming mode writes the same fingerprint
+    int fds[2];
+    panic_if(pipe(fds) != 0, "Cannot create pipe");
+    size_t len = strlen(source);
+    panic_if(write(fds[1], source, len) != len, "Cannot write to pipe");
+    close(fds[1]);
+    headify_stream(fds[0], "test", make_string("a"), piped_head, piped_impl, &options);
+    close(fds[0]);
+    String streamed = read_file(piped_head);
+    test_equal_s(streamed, actual.s);
+    free(streamed.s);
+    free(actual.s);
+    // other options and other source texts have other fingerprints
+    options.strip_comments = false;
+    test_equal_i(check_file(name, &options, &message), 1);
+    free(message.s);
+    options.strip_comments = true;
+    write_file(name, make_string("*int g;\n"));
+    test_equal_i(check_file(name, &options, &message), 1);
+    free(message.s);
+    test_equal_i(check_files(&files, &options, 1), 1);
+    test_equal_i(headify_batch(&files, &options, 1, false), 0);
+    test_equal_i(check_file(name, &options, &message), 0);
+    // missing outputs are out of date, missing sources cannot be checked
+    unlink(impl);
+    test_equal_i(check_file(name, &options, &message), 1);
+    free(message.s);
+    unlink(name);
+    test_equal_i(check_file(name, &options, &message), 2);
+    free(message.s);
+    free_file_list(&files);
+    unlink(head);
+    unlink(piped_head);
+    unlink(piped_impl);
+    rmdir(dir);
+}
+
+/*
+Headifies a synthetic source file of more than 4 GiB, which consists of a large
+array definition followed by a few small phrases. The initializer of the array
+is a single element of more than 4 GiB. Offsets, lengths, and line numbers
+beyond 2^32 must not overflow. The test takes about a minute and creates two
+temporary files of more than 4 GiB each, so it only runs if HEADIFY_LARGE_TEST
+names the directory for them, e.g., HEADIFY_LARGE_TEST=/var/tmp.
+*/
+void large_file_test(void) {
+    char* parent = getenv("HEADIFY_LARGE_TEST");
+    if (parent == NULL || parent[0] == '\0') {
+        printf("large_file_test skipped, set HEADIFY_LARGE_TEST to a directory to run it\n");
+        return;
+    }
+    String dir = new_string(strlen(parent) + 32);
+    dir.len = snprintf(dir.s, dir.cap, "%s/headify_large_testXXXXXX", parent);
+    panicf_if(mkdtemp(dir.s) == NULL, "Cannot create %s", dir.s);
+    size_t n = dir.len + 16;
+    char* name = xmalloc(n);
+    char* impl_name = xmalloc(n);
+    snprintf(name, n, "%s/large.h.c", dir.s);
+    snprintf(impl_name, n, "%s/large.c", dir.s);
+    size_t size = ((size_t)1 << 32) + ((size_t)1 << 28);
+    FILE* f = fopen(name, "w");
+    panicf_if(f == NULL, "Cannot open %s", name);
+    char line[1024];
+    for (int i = 0; i < sizeof(line) - 1; i += 4) memcpy(line + i, "123,", 4);
+    line[sizeof(line) - 1] = '\n';
+    fputs("*int values[] = {\n", f);
+    size_t lines = size / sizeof(line);
+    for (size_t i = 0; i < lines; i++) fwrite(line, 1, sizeof(line), f);
+    char* tail = "0};\n*int f(void) {\n    return values[0];\n}\nint g;\n"
+        "int main(void) {\n    return f() + g;\n}\n";
+    fputs(tail, f);
+    fclose(f);
+
+    FileData source_file = load_file(name);
+    String source = source_file.data;
+    test_equal_i(source.len > UINT32_MAX, true);
+    Arena arena = make_arena(64 * 1024);
+    ElementTable elements = get_elements(&arena, name, source.s, 1);
+    PhraseTable phrases = get_phrases(&arena, name, &elements);
+    test_equal_i(phrases.count, 4);
+    Phrase values = phrases.a[0];
+    test_equal_i(values.type, arr_def);
+    test_equal_i(elements.lengths[values.last - 1] > UINT32_MAX, true);
+    Phrase g = phrases.a[2];
+    test_equal_i(g.type, var_dec);
+    char* g_begin = element_begin(&elements, g.first);
+    test_equal_i(strncmp(g_begin, "int g;", 6), 0);
+    test_equal_i(line_of(&elements.lines, g_begin - source.s) == lines + 6, true);
+
+    Segments head = new_segments(16);
+    Segments impl = new_segments(16);
+    create_outputs(make_string("large"), &elements, &phrases, &head, &impl);
+    String h = segments_to_string(&head);
+    test_equal_s(h, "#ifndef large_h_INCLUDED\n#define large_h_INCLUDED\n"
+            "extern int values[];\nint f(void);\n#endif\n");
+    free(h.s);
+    // the public signifiers are removed, "static " is inserted before g
+    test_equal_i(impl.len == source.len - 2 + 7, true);
+    write_segments(impl_name, &impl);
+    FileData impl_file = load_file(impl_name);
+    String c = impl_file.data;
+    test_equal_i(c.len == impl.len, true);
+    size_t k = source.len - 1 - strlen(tail);
+    test_equal_i(memcmp(c.s, source.s + 1, k), 0);
+    test_equal_i(strcmp(c.s + k, "0};\nint f(void) {\n    return values[0];\n}\n"
+        "static int g;\nint main(void) {\n    return f() + g;\n}\n"), 0);
+
+    release_file(&impl_file);
+    free_segments(&head);
+    free_segments(&impl);
+    arena_free(&arena);
+    release_file(&source_file);
+    unlink(name);
+    unlink(impl_name);
+    rmdir(dir.s);
+    free(name);
+    free(impl_name);
+    free(dir.s);
+}
+
+/*
+Runs headify with the command line arguments. Returns the exit status. Invalid
+arguments, unreadable files, and malformed source texts are reported and fail
+the command without exiting the process. The elements and phrases of a single
+file are allocated from the arena, which is reset afterwards, so that a server
+reuses its blocks for the next command.
+*/
+int headify_command(Arena* arena, int argc, char* argv[]) {
+    require_not_null(arena);
+    Options options = {false, false, false, NULL};
+    // the cache directory may be given in the environment, e.g. for make
+    char* cache = getenv("HEADIFY_CACHE");
+    if (cache != NULL && cache[0] != '\0') options.cache = cache;
+    FileList files = {0, 0, NULL};
+    bool batch = false;
+    bool check = false;
+    int threads = processor_count();
+    // a single file is scanned and parsed on one thread, unless requested
+    // otherwise
+    int file_threads = 1;
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--canonical") == 0) {
+            options.canonical = true;
+        } else if (strcmp(argv[arg], "--strip-comments") == 0) {
+            options.canonical = true;
+            options.strip_comments = true;
+        } else if (strcmp(argv[arg], "--files-from") == 0 && arg + 1 < argc) {
+            if (!read_file_list(&files, argv[++arg])) {
+                free_file_list(&files);
+                return EXIT_FAILURE;
+            }
+            batch = true;
+        } else if (strcmp(argv[arg], "--fingerprint") == 0) {
+            options.fingerprint = true;
+        } else if (strcmp(argv[arg], "--check") == 0) {
+            check = true;
+        } else if (strcmp(argv[arg], "--cache") == 0 && arg + 1 < argc) {
+            options.cache = argv[++arg];
+        } else if (strcmp(argv[arg], "--jobs") == 0 && arg + 1 < argc) {
+            threads = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+            file_threads = atoi(argv[++arg]);
+        } else {
+            printf("Unknown option %s\n", argv[arg]);
+            free_file_list(&files);
+            return EXIT_FAILURE;
+        }
+    }
+    // with "-", the source text is read from stdin, the file name
+    // determines the output files
+    bool stream = argc - arg == 2 && strcmp(argv[arg], "-") == 0;
+    // several files or file lists are processed as a batch, and so are the
+    // files to check
+    batch = batch || argc - arg > 1 || (argc - arg == 1 && (argv[arg][0] == '@' || check));
+    if ((argc - arg != 1 && !stream && !batch) || (check && stream) || threads < 1 
+            || file_threads < 1) {
+        printf("Usage: headify [options] <filename C file>\n");
+        printf("       headify [options] - <filename C file> < <C source text>\n");
+        printf("       headify [options] <filename C file | @list file>...\n");
+        printf("       headify --serve <socket>\n");
+        printf("       headify --client <socket> <arguments as above>\n");
+        printf("Options:\n");
+        printf("  --canonical       write the header file in canonical form\n");
+        printf("  --strip-comments  write the header file in canonical form without comments\n");
+        printf("  --fingerprint     start the header file with a fingerprint of the source text\n");
+        printf("  --check           only check the fingerprints of the header files, exit with 1\n");
+        printf("                    if any is out of date, with 2 if any file cannot be read;\n");
+        printf("                    pass the same --canonical or --strip-comments option as\n");
+        printf("                    when generating them\n");
+        printf("  --files-from <list file>\n");
+        printf("                    process the files in the list (\"-\" for stdin), one per line\n");
+        printf("                    or separated by '\\0'\n");
+        printf("  --jobs <n>        process up to n files at a time (default: processors)\n");
+        printf("  --threads <n>     scan and parse a large file on up to n threads (default: 1)\n");
+        printf("  --cache <dir>     take unchanged outputs from the cache directory and store\n");
+        printf("                    new outputs in it (default: $HEADIFY_CACHE)\n");
+        free_file_list(&files);
+        return EXIT_FAILURE;
+    }
+
+    if (batch && !stream) {
+        for (; arg < argc; arg++) {
+            if (argv[arg][0] == '@') {
+                if (!read_file_list(&files, argv[arg] + 1)) {
+                    free_file_list(&files);
+                    return EXIT_FAILURE;
+                }
+            } else {
+                append_file_name(&files, argv[arg], strlen(argv[arg]));
+            }
+        }
+        if (check) {
+            // the outputs to check were created with a fingerprint
+            options.fingerprint = true;
+            int result = check_files(&files, &options, threads);
+            free_file_list(&files);
+            return result;
+        }
+        int failed = headify_batch(&files, &options, threads, false);
+        free_file_list(&files);
+        return failed > 0 ? EXIT_FAILURE : 0;
+    }
+
+    String filename = make_string(argv[argc - 1]);
+    FileNames names;
+    if (!make_file_names(filename.s, &names)) {
+        printf("Usage: headify <filename C file>\n");
+        return EXIT_FAILURE;
+    }
+    String basename = names.basename;
+    String headname = names.headname;
+    String implname = names.implname;
+
+    if (stream) {
+        bool ok = headify_stream(STDIN_FILENO, filename.s, basename, headname.s, implname.s, 
+                &options);
+        free_file_names(&names);
+        return ok ? 0 : EXIT_FAILURE;
+    }
+
+    FileData source_file;
+    if (!try_load_file(filename.s, &source_file)) {
+        fprintf(stderr, "%s: Cannot open\n", filename.s);
+        free_file_names(&names);
+        return EXIT_FAILURE;
+    }
+    String source_code = source_file.data;
+    uint64_t source_hash[2];
+    if (options.cache != NULL || options.fingerprint) {
+        hash128(source_code.s, source_code.len, 0, source_hash);
+    }
+    CacheEntry cached = {{NULL, 0, 0}, {NULL, 0, 0}, {NULL, 0, 0}};
+    if (options.cache != NULL) {
+        make_cache_entry(&options, basename, source_hash, &cached);
+        if (fetch_cached_outputs(&cached, &names)) {
+            free_cache_entry(&cached);
+            free_file_names(&names);
+            release_file(&source_file);
+            return 0;
+        }
+    }
+    ElementTable elements;
+    bool ok = try_get_elements(arena, filename.s, source_code.s, file_threads, &elements);
+    if (ok && DEBUG) print_elements(&elements);
+
+#if 0
+    Phrase phrase = get_phrase(&elements, 0);
+    printf("phrase = %s\n", PhraseTypeNames[phrase.type]);
+    print_phrase(&elements, &phrase);
+#endif
+
+    // the contents refer to the source code, which is kept until they are written
+    Segments head = new_segments(1024);
+    Segments impl = new_segments(1024);
+    // large element tables are parsed in partitions only if requested
+    threads = elements.count / PARSE_PARTITION_MIN;
+    if (threads > file_threads) threads = file_threads;
+    if (threads > processor_count()) threads = processor_count();
+    if (ok && threads > 1) {
+        ok = create_outputs_parallel(filename.s, basename, &elements, threads, &head, &impl);
+    } else if (ok) {
+        PhraseTable phrases;
+        ok = try_get_phrases(arena, filename.s, &elements, &phrases);
+        if (ok && DEBUG) print_phrases(&elements, &phrases);
+        if (ok) create_outputs(basename, &elements, &phrases, &head, &impl);
+    }
+
+    String canonical = {NULL, 0, 0};
+    char fingerprint[FINGERPRINT_LENGTH + 1];
+    if (ok) {
+        if (options.canonical) {
+            canonicalize_header(&head, &canonical, options.strip_comments);
+        }
+        if (options.fingerprint) {
+            make_fingerprint(&options, basename, source_hash, fingerprint);
+            prepend_fingerprint(&head, fingerprint);
+        }
+        // unchanged outputs keep their modification time
+        write_segments_if_changed(headname.s, &head);
+        write_segments_if_changed(implname.s, &impl);
+        if (options.cache != NULL) {
+            store_cached_outputs(options.cache, &cached, &head, &impl);
+        }
+    }
+    if (options.cache != NULL) free_cache_entry(&cached);
+    free(canonical.s);
+    free_segments(&head);
+    free_segments(&impl);
+    free_file_names(&names);
+
+    // a failed command leaves the arena ready for the next one as well
+    arena_reset(arena);
+    release_file(&source_file);
+    return ok ? 0 : EXIT_FAILURE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Server
+
+/*
+A request to the server consists of a message that carries the standard input,
+output, and error of the client (SCM_RIGHTS) and the length of the arguments,
+followed by the arguments: the working directory of the client, the value of
+HEADIFY_CACHE (empty if it is not set), and the command line arguments, each
+terminated by '\0'. The server replies with the exit status as an int.
+*/
+#define REQUEST_MAX (1 << 20)
+
+/*
+Fills in the address of the socket. Fails if the name is too long.
+*/
+void make_socket_address(char* name, struct sockaddr_un* address) {
+    require_not_null(name);
+    require_not_null(address);
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    panicf_if(strlen(name) >= sizeof(address->sun_path), "Socket name too long: %s", name);
+    strcpy(address->sun_path, name);
+}
+
+/*
+Connects to the socket. Returns -1 if no server listens on it.
+*/
+int connect_socket(char* name) {
+    struct sockaddr_un address;
+    make_socket_address(name, &address);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    panicf_if(fd < 0, "Cannot create socket (%d)", errno);
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+Reads exactly n bytes. Returns false if the connection ends before.
+*/
+bool read_fully(int fd, void* buf, size_t n) {
+    char* p = buf;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+/*
+Writes exactly n bytes. Returns false if the connection ends before.
+*/
+bool write_fully(int fd, void* buf, size_t n) {
+    char* p = buf;
+    while (n > 0) {
+        ssize_t r = write(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+/*
+Sends the command line arguments and the standard file descriptors of this
+process to the server and waits for the exit status. Returns -1 if no server
+listens on the socket, in which case the caller runs the command itself.
+*/
+int run_client(char* socket_name, int argc, char* argv[]) {
+    require_not_null(socket_name);
+    require_not_null(argv);
+    int fd = connect_socket(socket_name);
+    if (fd < 0) return -1;
+    String request = new_string(1024);
+    char* cwd = getcwd(NULL, 0);
+    panicf_if(cwd == NULL, "Cannot get working directory (%d)", errno);
+    xappend_cstring(&request, cwd);
+    xappend_char(&request, '\0');
+    free(cwd);
+    char* cache = getenv("HEADIFY_CACHE");
+    xappend_cstring(&request, cache != NULL ? cache : "");
+    xappend_char(&request, '\0');
+    for (int i = 0; i < argc; i++) {
+        xappend_cstring(&request, argv[i]);
+        xappend_char(&request, '\0');
+    }
+    panicf_if(request.len > REQUEST_MAX, "Too many arguments");
+
+    uint32_t len = request.len;
+    struct iovec iov = {&len, sizeof(len)};
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    int status = EXIT_FAILURE;
+    if (sendmsg(fd, &msg, 0) != sizeof(len) || !write_fully(fd, request.s, request.len) 
+            || !read_fully(fd, &status, sizeof(status))) {
+        fprintf(stderr, "headify: server on %s failed\n", socket_name);
+        status = EXIT_FAILURE;
+    }
+    free(request.s);
+    close(fd);
+    return status;
+}
+
+/*
+The number of worker processes of the server. Each worker runs one request at
+a time, further requests wait until a worker accepts them.
+*/
+#define SERVER_WORKERS 4
+
+/*
+The connection of the request that this worker process runs, -1 if none.
+*/
+static int request_conn = -1;
+
+/*
+The worker processes of the server.
+*/
+static pid_t server_workers[SERVER_WORKERS];
+
+static volatile sig_atomic_t server_stopped = 0;
+
+/*
+Replies with a failure if the request exits the worker process, which only
+happens for internal errors, e.g., if an output file cannot be written. The
+server then starts a new worker.
+*/
+static void reply_at_exit(void) {
+    if (request_conn < 0) return;
+    fflush(NULL);
+    int status = EXIT_FAILURE;
+    write_fully(request_conn, &status, sizeof(status));
+}
+
+/*
+Stops the workers when the server is terminated.
+*/
+static void stop_server(int sig) {
+    (void)sig;
+    server_stopped = 1;
+    for (int i = 0; i < SERVER_WORKERS; i++) {
+        if (server_workers[i] > 0) kill(server_workers[i], SIGTERM);
+    }
+}
+
+/*
+Receives a request and runs it in this worker process with the standard input,
+output, and error and the working directory of the client. Afterwards the
+standard file descriptors are restored from saved, the working directory from
+cwd. Replies with the exit status.
+*/
+void run_request(Arena* arena, int conn, int saved[3], int cwd) {
+    uint32_t len = 0;
+    int fds[3] = {-1, -1, -1};
+    struct iovec iov = {&len, sizeof(len)};
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t n;
+    do n = recvmsg(conn, &msg, 0); while (n < 0 && errno == EINTR);
+    if (n < 0) return;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) return;
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), (count < 3 ? count : 3) * sizeof(int));
+    char* request = NULL;
+    int argc = 0;
+    if (n == sizeof(len) && len <= REQUEST_MAX && count == 3) {
+        request = xmalloc(len + 1);
+        if (read_fully(conn, request, len)) {
+            request[len] = '\0';
+            // count the arguments
+            for (uint32_t i = 0; i < len; i++) {
+                if (request[i] == '\0') argc++;
+            }
+        }
+    }
+    if (argc < 2) {
+        // a malformed request, close the file descriptors that came with it
+        for (int i = 0; i < 3; i++) {
+            if (fds[i] >= 0) close(fds[i]);
+        }
+        free(request);
+        return;
+    }
+    char** argv = xcalloc(argc + 1, sizeof(char*));
+    char* p = request;
+    for (int i = 0; i < argc; i++) {
+        argv[i] = p;
+        p += strlen(p) + 1;
+    }
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    int status = EXIT_FAILURE;
+    if (chdir(argv[0]) != 0) {
+        fprintf(stderr, "headify: cannot change to %s\n", argv[0]);
+    } else {
+        if (argv[1][0] != '\0') {
+            setenv("HEADIFY_CACHE", argv[1], 1);
+        } else {
+            unsetenv("HEADIFY_CACHE");
+        }
+        // the command line starts with the program name
+        argv[1] = "headify";
+        request_conn = conn;
+        status = headify_command(arena, argc - 1, argv + 1);
+        request_conn = -1;
+    }
+    // the outputs of the request go to the client
+    fflush(NULL);
+    clearerr(stdout);
+    clearerr(stderr);
+    for (int i = 0; i < 3; i++) dup2(saved[i], i);
+    panicf_if(fchdir(cwd) != 0, "Cannot restore working directory (%d)", errno);
+    write_fully(conn, &status, sizeof(status));
+    free(argv);
+    free(request);
+}
+
+/*
+Accepts requests on the listening socket and runs them one after the other in
+this worker process, which keeps its arena and heap from one request to the
+next. A request that fails replies with its exit status like any other. The
+worker only exits on internal errors or if the server terminates. Never
+returns.
+*/
+void serve_requests(int fd, pid_t server) {
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+#ifdef __linux__
+    // the worker ends with the server, even if the server is killed
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+    if (getppid() != server) _exit(EXIT_FAILURE);
+    // a client that goes away must not end the worker while it writes
+    signal(SIGPIPE, SIG_IGN);
+    atexit(reply_at_exit);
+    int saved[3];
+    for (int i = 0; i < 3; i++) {
+        saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+        panicf_if(saved[i] < 0, "Cannot save file descriptor %d (%d)", i, errno);
+    }
+    int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    panicf_if(cwd < 0, "Cannot open working directory (%d)", errno);
+    Arena arena = make_arena(64 * 1024);
+    while (true) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) continue;
+        run_request(&arena, conn, saved, cwd);
+        close(conn);
+    }
+}
+
+/*
+Starts a worker process that serves requests on the listening socket.
+*/
+pid_t start_worker(int fd) {
+    pid_t server = getpid();
+    fflush(NULL);
+    pid_t pid = fork();
+    panicf_if(pid < 0, "Cannot fork (%d)", errno);
+    if (pid == 0) serve_requests(fd, server);
+    return pid;
+}
+
+/*
+Listens on the socket and serves requests in a fixed number of long-lived
+worker processes, which change to the working directory of the client and use
+its standard input, output, and error. A request thus neither starts a new
+program nor a new process, and reuses the memory of earlier requests. A
+request that runs into an internal error exits its worker, which the server
+then replaces, so it cannot affect the server or other requests. The socket is
+only accessible to the user that runs the server, because the workers run
+requests with the permissions of that user. Never returns.
+*/
+void serve(char* socket_name) {
+    require_not_null(socket_name);
+    int fd = connect_socket(socket_name);
+    if (fd >= 0) {
+        fprintf(stderr, "headify: a server already listens on %s\n", socket_name);
+        exit(EXIT_FAILURE);
+    }
+    // the workers replace the standard file descriptors, which thus must not
+    // be reused for sockets
+    for (int i = 0; i < 3; i++) {
+        if (fcntl(i, F_GETFD) < 0) open("/dev/null", O_RDWR);
+    }
+    // remove the socket of a server that no longer runs
+    unlink(socket_name);
+    struct sockaddr_un address;
+    make_socket_address(socket_name, &address);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    panicf_if(fd < 0, "Cannot create socket (%d)", errno);
+    // bind creates the socket file with mode 0600
+    mode_t mask = umask(0177);
+    int r = bind(fd, (struct sockaddr*)&address, sizeof(address));
+    umask(mask);
+    panicf_if(r != 0, "Cannot bind socket %s (%d)", socket_name, errno);
+    panicf_if(listen(fd, 64) != 0, "Cannot listen on socket %s (%d)", socket_name, errno);
+    // without SA_RESTART, so that a signal interrupts waiting for the workers
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_server;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    for (int i = 0; i < SERVER_WORKERS; i++) {
+        server_workers[i] = start_worker(fd);
+    }
+    // replace workers that exit because their request failed
+    while (!server_stopped) {
+        pid_t pid = wait(NULL);
+        if (pid < 0 || server_stopped) continue;
+        for (int i = 0; i < SERVER_WORKERS; i++) {
+            if (server_workers[i] == pid) server_workers[i] = start_worker(fd);
+        }
+    }
+    for (int i = 0; i < SERVER_WORKERS; i++) {
+        kill(server_workers[i], SIGTERM);
+        waitpid(server_workers[i], NULL, 0);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+/*
+Starts a server, runs commands through it, and checks the outputs and the exit
+statuses.
+*/
+void serve_test(void) {
+    char dir[] = "/tmp/headify_serve_testXXXXXX";
+    panicf_if(mkdtemp(dir) == NULL, "Cannot create %s", dir);
+    char socket_name[64], name[64], head[64], impl[64];
+    snprintf(socket_name, sizeof(socket_name), "%s/socket", dir);
+    snprintf(name, sizeof(name), "%s/a.h.c", dir);
+    snprintf(head, sizeof(head), "%s/a.h", dir);
+    snprintf(impl, sizeof(impl), "%s/a.c", dir);
+    char* args[] = {"--canonical", name};
+    test_equal_i(run_client(socket_name, 0, args), -1);
+    fflush(NULL);
+    pid_t server = fork();
+    panicf_if(server < 0, "Cannot fork (%d)", errno);
+    if (server == 0) serve(socket_name);
+    // wait until the server listens
+    int fd;
+    for (int i = 0; i < 1000 && (fd = connect_socket(socket_name)) < 0; i++) {
+        usleep(1000);
+    }
+    panicf_if(fd < 0, "Server did not start");
+    close(fd);
+    // only the user that runs the server may connect
+    struct stat st;
+    test_equal_i(stat(socket_name, &st), 0);
+    test_equal_i(st.st_mode & 0777, 0600);
+
+    write_file(name, make_string("*int f(void) {\n  return 1;\n}\nint g;\n"));
+    test_equal_i(run_client(socket_name, 2, args), 0);
+    String actual = read_file(head);
+    test_equal_s(actual, "#ifndef a_h_INCLUDED\n#define a_h_INCLUDED\nint f(void);\n#endif\n");
+    free(actual.s);
+    actual = read_file(impl);
+    test_equal_s(actual, "int f(void) {\n  return 1;\n}\nstatic int g;\n");
+    free(actual.s);
+    // relative names are resolved in the working directory of the client
+    unlink(head);
+    char* cwd = getcwd(NULL, 0);
+    panicf_if(chdir(dir) != 0, "Cannot change to %s", dir);
+    char* relative_args[] = {"a.h.c"};
+    test_equal_i(run_client(socket_name, 1, relative_args), 0);
+    panicf_if(chdir(cwd) != 0, "Cannot change to %s", cwd);
+    free(cwd);
+    test_equal_i(access(head, F_OK), 0);
+    // failing commands do not affect the server and do not exit the workers
+#ifdef __linux__
+    char children_name[64];
+    snprintf(children_name, sizeof(children_name), "/proc/%d/task/%d/children", 
+            (int)server, (int)server);
+    FileData workers_before = {{NULL, 0, 0}, 0};
+    bool have_workers = try_load_file(children_name, &workers_before);
+#endif
+    write_file(name, make_string("int f( {\n"));
+    int saved = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    for (int i = 0; i <= SERVER_WORKERS; i++) {
+        test_equal_i(run_client(socket_name, 1, args + 1), EXIT_FAILURE);
+    }
+    char* stream_args[] = {"-", name};
+    int stdin_saved = dup(STDIN_FILENO);
+    int input = open(name, O_RDONLY);
+    dup2(input, STDIN_FILENO);
+    test_equal_i(run_client(socket_name, 2, stream_args), EXIT_FAILURE);
+    dup2(stdin_saved, STDIN_FILENO);
+    close(stdin_saved);
+    close(input);
+    char* missing_name_args[] = {"--canonical", "/nonexistent/b.h.c"};
+    test_equal_i(run_client(socket_name, 2, missing_name_args), EXIT_FAILURE);
+    char* missing_list_args[] = {"--files-from", "/nonexistent/list"};
+    test_equal_i(run_client(socket_name, 2, missing_list_args), EXIT_FAILURE);
+#ifdef __linux__
+    if (have_workers) {
+        FileData workers_after = load_file(children_name);
+        test_equal_s(workers_after.data, workers_before.data.s);
+        release_file(&workers_before);
+        release_file(&workers_after);
+    }
+#endif
+    char* check_args[] = {"--check", name};
+    test_equal_i(run_client(socket_name, 2, check_args), 1);
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+    close(null);
+    char* missing_args[] = {"--check", "--files-from", "/dev/null"};
+    test_equal_i(run_client(socket_name, 3, missing_args), 0);
+    // the workers run one command after the other with the same arena
+    write_file(name, make_string("*int f(void) {\n  return 1;\n}\nint g;\n"));
+    for (int i = 0; i <= 2 * SERVER_WORKERS; i++) {
+        unlink(head);
+        test_equal_i(run_client(socket_name, 2, args), 0);
+        actual = read_file(head);
+        test_equal_s(actual, "#ifndef a_h_INCLUDED\n#define a_h_INCLUDED\nint f(void);\n#endif\n");
+        free(actual.s);
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    test_equal_i(run_client(socket_name, 0, args), -1);
+    unlink(socket_name);
+    unlink(name);
+    unlink(head);
+    unlink(impl);
+    rmdir(dir);
+}
+
+int main(int argc, char* argv[]) {
+    // split_test();
+    // split_lines_test();
+    // indentation_test();
+    // next_state_test();
+    // trim_test();
+    // trim_left_test();
+    // trim_right_test();
+    // index_of_test();
+    // append_test();
+    // xappend_test();
+    // arena_test();
+    // segments_test();
+    // load_file_test();
+    // write_segments_if_changed_test();
+    // copy_file_if_changed_test();
+    // hash128_test();
+    // keyword_test();
+    // line_table_test();
+    // scan_next_test();
+    // block_scan_test();
+    // get_elements_parallel_test();
+    // get_phrase_test();
+    // phrase_anchors_test();
+    // create_outputs_parallel_test();
+    // canonical_header_test();
+    // headify_stream_test();
+    // headify_batch_test();
+    // cache_test();
+    // output_version_test();
+    // fingerprint_test();
+    // io_ring_test();
+    // large_file_test();
+    // serve_test();
+    // exit(0);
+
+    if (argc == 3 && strcmp(argv[1], "--serve") == 0) {
+        serve(argv[2]);
+    }
+    if (argc >= 3 && strcmp(argv[1], "--client") == 0) {
+        int status = run_client(argv[2], argc - 3, argv + 3);
+        if (status >= 0) return status;
+        // no server is running, so run the command in this process
+        argv[2] = argv[0];
+        argc -= 2;
+        argv += 2;
+    }
+    Arena arena = make_arena(64 * 1024);
+    int status = headify_command(&arena, argc, argv);
+    arena_free(&arena);
+    return status;
 }
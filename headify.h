@@ -9,6 +9,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
@@ -67,7 +69,98 @@ struct Element {
     ElementType type;
     char* begin; // inclusive
     char* end; // exclusive
-    Element* next;
+};
+
+/*
+The offsets of all line breaks in a source text in ascending order.
+*/
+typedef struct LineTable LineTable;
+struct LineTable {
+    ptrdiff_t count;
+    ptrdiff_t cap;
+    size_t* breaks;
+};
+
+/*
+Keywords that the parser and the emitters distinguish. Tokens are classified
+once, when they are added to the element table. Other tokens and other
+elements have keyword kw_none.
+*/
+typedef enum Keyword Keyword;
+enum Keyword {
+    kw_none, kw_struct, kw_union, kw_enum, kw_typedef, 
+    kw_static, kw_extern, kw_inline, kw_main, KeywordCount
+};
+
+/*
+The elements of a source text are stored in a compact table, walked by index.
+Element i has type types[i] and extends from source + begins[i] (inclusive) to
+source + begins[i] + lengths[i] (exclusive). Tokens that are keywords have
+keyword keywords[i]. Index count denotes "no element".
+*/
+typedef struct ElementTable ElementTable;
+struct ElementTable {
+    char* source;
+    ptrdiff_t count;
+    ptrdiff_t cap;
+    unsigned char* types;
+    size_t* begins;
+    size_t* lengths;
+    unsigned char* keywords;
+    LineTable lines; // line breaks of the source
+};
+
+/*
+The state of the scan of a group that has not been closed yet, taken at the
+last position from which the scan can be resumed. A position is such a
+checkpoint if at least two characters follow it, because the scanner looks
+ahead by up to two characters. Offsets are relative to the opening brace of
+the group, so that the text may move between the calls of skip_group.
+*/
+typedef struct GroupState GroupState;
+struct GroupState {
+    bool valid; // is there a checkpoint to resume from?
+    ptrdiff_t* open; // stack of the offsets of the unmatched opening braces
+    ptrdiff_t count; // number of unmatched opening braces at the checkpoint
+    ptrdiff_t cap;
+    ptrdiff_t top; // top entry of the stack at the checkpoint
+    ptrdiff_t pos; // offset of the checkpoint
+    ptrdiff_t floor; // offset after the last brace, literal, comment, or directive
+    bool indent; // indent state at the checkpoint
+};
+
+/*
+The scanner state that is carried from one element to the next. Each source
+text gets its own scanner, so that several texts may be scanned concurrently.
+*/
+typedef struct Scanner Scanner;
+struct Scanner {
+    bool indent; // is the scanner in the indentation region of a line?
+    char* error_message; // error message in case of an error
+    char* error_pos; // error position in case of an error
+    // optional bounds of the source text, NULL if not known, with which the
+    // contents of groups are classified 64 characters at a time
+    char* source; // beginning of the source text
+    size_t length; // length of the source text
+    char* block; // beginning of the last classified block, NULL if none
+    uint64_t group_chars; // bit i is set iff block[i] is a group character
+    // state of an incomplete group to resume from, NULL if groups are always
+    // scanned from the beginning
+    GroupState* group;
+};
+
+/*
+A chunk of the source text that is scanned speculatively on its own thread.
+*/
+typedef struct ScanChunk ScanChunk;
+struct ScanChunk {
+    Scanner scanner; // scanner state at the exit of the chunk
+    Arena arena; // holds the elements of the chunk
+    ElementTable elements; // speculatively scanned elements
+    size_t start; // offset of the first character of the chunk
+    size_t end; // offset after the last character of the chunk
+    size_t exit; // offset at which the speculative scan stopped
+    bool failed; // did the speculative scan stop at an error?
 };
 
 /*
@@ -104,37 +197,244 @@ typedef struct Phrase Phrase;
 struct Phrase {
     PhraseType type;
     bool is_public; // is this a public phrase (to appear in the header file)?
-    // first..last is a linked list of elements belonging to this phrase
-    Element* first; // first element of phrase (inclusive)
-    Element* last; // last element of phrase (inclusive)
+    // first..last is a range of indices of elements belonging to this phrase
+    ptrdiff_t first; // first element of phrase (inclusive)
+    ptrdiff_t last; // last element of phrase (inclusive)
+    // anchors recorded during classification, -1 if not present
+    ptrdiff_t name; // last token before the declarator ends (e.g., function name)
+    ptrdiff_t asg; // assignment character of a variable or array definition
+    ptrdiff_t body; // curly braces of a function definition
+};
+
+/*
+The phrases of a source text in order of appearance.
+*/
+typedef struct PhraseTable PhraseTable;
+struct PhraseTable {
+    ptrdiff_t count;
+    ptrdiff_t cap;
+    Phrase* a;
+};
+
+/*
+A range of elements that is grouped into phrases and emitted on its own
+thread. The partition begins after a semicolon or at the first element.
+*/
+typedef struct Partition Partition;
+struct Partition {
+    ElementTable* elements; // all elements of the source text
+    ptrdiff_t first; // first element of the partition
+    ptrdiff_t stop; // element after the last element of the partition
+    char* begin; // beginning of the source text of the partition
+    char* end; // end of the source text of the partition
+    Arena arena; // holds the phrases of the partition
+    PhraseTable phrases; // phrases of the partition
+    ptrdiff_t error; // element at which the first erroneous phrase ends, or -1
+    Segments head; // part of the header file contents
+    Segments impl; // part of the implementation file contents
+};
+
+/*
+Command line options that affect the outputs.
+*/
+typedef struct Options Options;
+struct Options {
+    bool canonical; // write the header file in canonical form
+    bool strip_comments; // remove comments from the canonical header file
+    bool fingerprint; // start the header file with a fingerprint of the source text
+    char* cache; // directory of cached outputs, NULL if outputs are not cached
+};
+
+/*
+State of the streaming mode, which reads the source text from a file
+descriptor and writes the outputs as soon as phrases are complete. Only the
+part of the source text that has not been written yet is kept in memory.
+*/
+typedef struct Stream Stream;
+struct Stream {
+    int fd; // input file descriptor
+    bool eof; // has the end of the input been reached?
+    bool failed; // has an error been reported?
+    char* filename; // name of the input in error messages
+    String window; // part of the source text not written yet, followed by '\0'
+    ptrdiff_t lines; // number of line breaks before the window
+    LineTable breaks; // line breaks in the window, allocated with xrealloc
+    Arena arenas[2]; // the elements are allocated from arenas[current]
+    int current;
+    ElementTable elements; // complete elements at the beginning of the window
+    size_t scanned; // offset after the last complete element
+    Scanner scanner; // scanner state at offset scanned
+    GroupState group; // state of the incomplete group at offset scanned, if any
+    Options* options;
+    char* head_name;
+    char* impl_name;
+    String head_temp; // the outputs are written to temporary files
+    String impl_temp;
+    int head_fd;
+    int impl_fd;
+    Segments head; // header contents not written yet
+    String pending_head; // canonical mode: header text not at a declaration boundary yet
+    Segments impl; // implementation contents not written yet
+    Hasher hasher; // hash of the source text read so far, for the fingerprint
+};
+
+/*
+The names of the files that belong to a source file. The outputs are written to
+the directory of the source file.
+*/
+typedef struct FileNames FileNames;
+struct FileNames {
+    String basename; // without directory and extension, points into the source file name
+    String headname; // '\0'-terminated, allocated
+    String implname; // '\0'-terminated, allocated
+};
+
+/*
+The names of the cached outputs of a source text. The cache directory has a
+subdirectory for the first two hex digits of each key, so that no directory
+gets too large.
+*/
+typedef struct CacheEntry CacheEntry;
+struct CacheEntry {
+    String dir; // '\0'-terminated, allocated
+    String headname; // '\0'-terminated, allocated
+    String implname; // '\0'-terminated, allocated
+};
+
+/*
+The names of the source files of a batch.
+*/
+typedef struct FileList FileList;
+struct FileList {
+    int count;
+    int cap;
+    char** names; // allocated
+};
+
+/*
+A source file of a batch and the error message that processing it produced.
+*/
+typedef struct Job Job;
+struct Job {
+    char* filename;
+    size_t size; // file size, used for scheduling and memory accounting
+    String error; // allocated, empty if there was no error
+    // pipeline state, released when the job leaves the pipeline
+    int fd; // source file while it is read
+    String source; // source text, '\0'-terminated, len bytes read so far
+    Arena arena;
+    FileNames names;
+    Segments head;
+    Segments impl;
+    String canonical; // text of the canonical header, if requested
+    CacheEntry cached; // names of the cached outputs, if outputs are cached
+    char fingerprint[64]; // first line of the header file, if requested
+};
+
+/*
+Files whose outputs are checked concurrently. Each thread repeatedly takes the
+next file that has not been taken yet.
+*/
+typedef struct Check Check;
+struct Check {
+    FileList* files;
+    Options* options;
+    int* status; // results of check_file, in the order of the files
+    String* messages; // allocated, empty if the outputs are up to date
+    int next; // index of the next file to take
+    pthread_mutex_t lock; // protects next
+};
+
+/*
+A bounded queue of jobs between two stages of the batch pipeline.
+*/
+typedef struct JobQueue JobQueue;
+struct JobQueue {
+    Job** a; // ring buffer
+    int cap;
+    int first;
+    int count;
+    bool closed; // no more jobs will be pushed
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+/*
+A batch of source files that are processed in a pipeline: A reader thread
+reads the files, worker threads parse them, and a writer thread writes the
+outputs.
+*/
+typedef struct Batch Batch;
+struct Batch {
+    Job* jobs; // in the order given
+    int count;
+    Options* options;
+    bool synchronous; // do not use io_uring
+    JobQueue loaded; // jobs whose source text has been read
+    JobQueue parsed; // jobs whose outputs have been created
+    size_t memory; // size of the source text in the pipeline
+    pthread_mutex_t lock; // protects memory
+    pthread_cond_t released;
+};
+
+/*
+An output file of a job in the writer stage.
+*/
+typedef struct Output Output;
+struct Output {
+    char* name;
+    Segments* segs;
+    bool changed;
+    int fd;
+    char* existing; // contents of the existing file, if it has the same size
+    size_t done; // bytes of the existing file read so far
+    String temp; // name of the temporary file
+    struct iovec* iov; // one per segment
+};
+
+/*
+A part of an output file that is written with a single vectored write.
+*/
+typedef struct OutputChunk OutputChunk;
+struct OutputChunk {
+    int output; // index in the outputs
+    ptrdiff_t first; // index of the first segment
+    ptrdiff_t count; // number of segments
+    int64_t offset; // file offset of the first segment
+    size_t len; // number of bytes
 };
 
 typedef struct State State;
 struct State {
-    Element* input;
+    ElementTable* elements;
+    ptrdiff_t input;
     Phrase phrase;
 };
 
-void f_start(State* state);
-void f_pub(State* state);
-void f_tok(State* state);
-void f_tok_paren(State* state);
-void f_tok_paren_sem(State* state); // fun_dec	
-void f_tok_paren_curly(State* state); // fun_def
-void f_tok_sem(State* state); // var_dec
-void f_tok_asg(State* state);
-void f_tok_asg_sem(State* state); // var_def
-void f_tok_bracket(State* state);
-void f_tok_bracket_sem(State* state); // arr_dec
-void f_tok_bracket_asg(State* state);
-void f_tok_bracket_asg_sem(State* state); // arr_def
-void f_struct_union_enum(State* state);
-void f_struct_union_enum_sem(State* state); // struct_union_enum_def
-void f_typedef(State* state);
-void f_typedef_sem(State* state); // typedef_def
-void f_pre(State* state); // preproc
-void f_lco(State* state); // line_comment
-void f_bco(State* state); // block_comment
-void f_err(State* state); // error
+/*
+The states of the phrase recognizer. See the grammar above.
+*/
+typedef enum ParserState ParserState;
+enum ParserState {
+    p_start, p_pub, p_tok, p_tok_paren, p_tok_asg, p_tok_bracket, 
+    p_tok_bracket_asg, p_struct_union_enum, p_typedef, ParserStateCount
+};
+
+// input symbols of the phrase recognizer in addition to the element types
+enum { sue_kw = ElementTypeCount, typedef_kw, SymbolCount };
+
+typedef enum TransitionKind TransitionKind;
+enum TransitionKind { t_default, t_shift, t_accept };
+
+// anchors that a transition records at the current element
+typedef enum Anchor Anchor;
+enum Anchor { a_none, a_public, a_name, a_asg, a_body };
+
+typedef struct Transition Transition;
+struct Transition {
+    unsigned char kind; // TransitionKind
+    unsigned char target; // ParserState if shift, PhraseType if accept
+    unsigned char anchor; // Anchor
+};
 
 #endif // headify_h_INCLUDED
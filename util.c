@@ -3,7 +3,30 @@
 @date: November 28, 2021
 */
 
+// for MAP_ANONYMOUS and madvise
+#define _DEFAULT_SOURCE
+
 #include "util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h> // for FICLONE
+#include <sys/ioctl.h>
+#endif
+
+#if defined(__linux__) && !defined(NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 // Strings
@@ -22,17 +45,17 @@ point to the beginning of a dynamically allocated memory block.
 
 String make_string(char* s) {
     require_not_null(s);
-    int len = strlen(s);
+    ptrdiff_t len = strlen(s);
     return (String) {s, len, len};
 }
 
-String make_string2(char* s, int len) {
+String make_string2(char* s, ptrdiff_t len) {
     require_not_null(s);
     require("length not negative", len >= 0);
     return (String) {s, len, len};
 }
 
-String make_string3(char* s, int len, int cap) {
+String make_string3(char* s, ptrdiff_t len, ptrdiff_t cap) {
     require_not_null(s);
     require("length not negative", len >= 0);
     require("capacity not negative", cap >= 0);
@@ -40,7 +63,7 @@ String make_string3(char* s, int len, int cap) {
     return (String) {s, len, cap};
 }
 
-String new_string(int cap) {
+String new_string(ptrdiff_t cap) {
     require("capacity not negative", cap >= 0);
     return (String) {xmalloc(cap), 0, cap};
 }
@@ -50,7 +73,7 @@ Appends t to str. Fails if the result would not fit into str.
 */
 void append_string(String* str, String t) {
     require_not_null(str);
-    int n = str->len + t.len;
+    ptrdiff_t n = str->len + t.len;
     panic_if(n > str->cap, "append_string overflow");
     memcpy(str->s + str->len, t.s, t.len);
     str->len = n;
@@ -62,8 +85,8 @@ Appends t to str. Fails if the result would not fit into str.
 void append_cstring(String* str, char* t) {
     require_not_null(str);
     require_not_null(t);
-    int t_len = strlen(t);
-    int n = str->len + t_len;
+    ptrdiff_t t_len = strlen(t);
+    ptrdiff_t n = str->len + t_len;
     panic_if(n > str->cap, "append_cstring overflow");
     memcpy(str->s + str->len, t, t_len);
     str->len = n;
@@ -78,8 +101,8 @@ void append_cstring2(String* str, char* s, char* t) {
     require_not_null(s);
     require_not_null(t);
     require("t not before s", s <= t);
-    int st_len = t - s;
-    int n = str->len + st_len;
+    ptrdiff_t st_len = t - s;
+    ptrdiff_t n = str->len + st_len;
     panic_if(n > str->cap, "append_cstring overflow");
     memcpy(str->s + str->len, s, st_len);
     str->len = n;
@@ -95,22 +118,33 @@ void append_char(String* str, char c) {
     str->len++;
 }
 
+/*
+Makes room for at least n more chars in str. Grows the underlying buffer in
+place if possible, to at least twice its capacity, so that a sequence of
+appends takes amortized constant time per char. Thus str->s must point to the
+beginning of a dynamically allocated memory block.
+*/
+void xreserve(String* str, ptrdiff_t n) {
+    require_not_null(str);
+    require("not negative", n >= 0);
+    ptrdiff_t len = str->len + n;
+    if (len > str->cap) {
+        ptrdiff_t cap = 2 * str->cap;
+        if (cap < len) cap = len;
+        str->s = xrealloc(str->s, cap);
+        str->cap = cap;
+    }
+}
+
 /*
 Appends t to str. Extends the underlying buffer if the capacity is exhausted.
 Thus str->s must point to the beginning of a dynamically allocated memory block.
 */
 void xappend_string(String* str, String t) {
     require_not_null(str);
-    int n = str->len + t.len;
-    if (n > str->cap) {
-        char* s = xmalloc(2 * n);
-        memcpy(s, str->s, str->len);
-        free(str->s);
-        str->s = s;
-        str->cap = 2 * n;
-    }
+    if (str->len + t.len > str->cap) xreserve(str, t.len);
     memcpy(str->s + str->len, t.s, t.len);
-    str->len = n;
+    str->len += t.len;
 }
 
 /*
@@ -120,17 +154,10 @@ Thus str->s must point to the beginning of a dynamically allocated memory block.
 void xappend_cstring(String* str, char* t) {
     require_not_null(str);
     require_not_null(t);
-    int t_len = strlen(t);
-    int n = str->len + t_len;
-    if (n > str->cap) {
-        char* s = xmalloc(2 * n);
-        memcpy(s, str->s, str->len);
-        free(str->s);
-        str->s = s;
-        str->cap = 2 * n;
-    }
+    ptrdiff_t t_len = strlen(t);
+    if (str->len + t_len > str->cap) xreserve(str, t_len);
     memcpy(str->s + str->len, t, t_len);
-    str->len = n;
+    str->len += t_len;
 }
 
 /*
@@ -143,17 +170,10 @@ void xappend_cstring2(String* str, char* s, char* t) {
     require_not_null(s);
     require_not_null(t);
     require("t not before s", s <= t);
-    int st_len = t - s;
-    int n = str->len + st_len;
-    if (n > str->cap) {
-        char* s_new = xmalloc(2 * n);
-        memcpy(s_new, str->s, str->len);
-        free(str->s);
-        str->s = s_new;
-        str->cap = 2 * n;
-    }
+    ptrdiff_t st_len = t - s;
+    if (str->len + st_len > str->cap) xreserve(str, st_len);
     memcpy(str->s + str->len, s, st_len);
-    str->len = n;
+    str->len += st_len;
 }
 
 /*
@@ -162,18 +182,24 @@ Thus str->s must point to the beginning of a dynamically allocated memory block.
 */
 void xappend_char(String* str, char c) {
     require_not_null(str);
-    if (str->len >= str->cap) {
-        int n = 2 * (str->len + 1);
-        char* s = xmalloc(n);
-        memcpy(s, str->s, str->len);
-        free(str->s);
-        str->s = s;
-        str->cap = n;
-    }
+    if (str->len >= str->cap) xreserve(str, 1);
     str->s[str->len] = c;
     str->len++;
 }
 
+/*
+Appends n copies of c to str. Extends the underlying buffer if the capacity is
+exhausted. Thus str->s must point to the beginning of a dynamically allocated
+memory block.
+*/
+void xappend_chars(String* str, char c, ptrdiff_t n) {
+    require_not_null(str);
+    require("not negative", n >= 0);
+    if (str->len + n > str->cap) xreserve(str, n);
+    memset(str->s + str->len, c, n);
+    str->len += n;
+}
+
 void append_test(void) {
     String s = new_string(100);
     test_equal_s(s, "");
@@ -197,27 +223,46 @@ void append_test(void) {
 void xappend_test(void) {
     String s = new_string(1);
     xappend_char(&s, 'x');
-    printf("%d %d\n", s.len, s.cap);
+    printf("%td %td\n", s.len, s.cap);
     test_equal_s(s, "x");
     xappend_char(&s, 'y');
-    printf("%d %d\n", s.len, s.cap);
+    printf("%td %td\n", s.len, s.cap);
     test_equal_s(s, "xy");
     xappend_cstring(&s, "abc");
-    printf("%d %d\n", s.len, s.cap);
+    printf("%td %td\n", s.len, s.cap);
     test_equal_s(s, "xyabc");
     xappend_string(&s, make_string("hello"));
-    printf("%d %d\n", s.len, s.cap);
+    printf("%td %td\n", s.len, s.cap);
     test_equal_s(s, "xyabchello");
     test_equal_i(s.len, 10);
+    xappend_chars(&s, '\n', 3);
+    test_equal_s(s, "xyabchello\n\n\n");
+    xappend_chars(&s, '\n', 0);
+    test_equal_i(s.len, 13);
+    free(s.s);
+
+    s = new_string(1);
+    xreserve(&s, 100);
+    test_equal_i(s.len, 0);
+    test_equal_i(s.cap, 100);
+    char* t = s.s;
+    xappend_chars(&s, 'z', 100);
+    test_equal_i(s.len, 100);
+    test_equal_i(s.cap, 100);
+    test_equal_i(t == s.s, true);
+    xappend_char(&s, 'z');
+    test_equal_i(s.len, 101);
+    test_equal_i(s.cap, 200);
     free(s.s);
 }
 
 void print_string(String str) {
-    printf("%.*s", str.len, str.s);
+    fwrite(str.s, 1, str.len, stdout);
 }
 
 void println_string(String str) {
-    printf("%.*s\n", str.len, str.s);
+    fwrite(str.s, 1, str.len, stdout);
+    putchar('\n');
 }
 
 /*
@@ -226,12 +271,12 @@ content is not modified, but the String is appropriately shifted and the length
 adapted.
 */
 String trim(String str) {
-    int left = 0, right = str.len - 1;
+    ptrdiff_t left = 0, right = str.len - 1;
     for (; left < str.len && (str.s[left] == ' ' || str.s[left] == '\t' ); left++);
     // 0 <= left <= str.len
     for (; right >= left && (str.s[right] == ' ' || str.s[right] == '\t' ); right--);
     // -1 <= left - 1 <= right <= str.len - 1
-    int len = right - left + 1;
+    ptrdiff_t len = right - left + 1;
     // 0 <= right - left + 1 <= str.len - left
     // 0 <= len <= str.len - left <= str.len
     assert("not negative", len >= 0);
@@ -259,10 +304,10 @@ Removes spaces and tabs from the beginning of str. The underlying content is not
 modified, but the String is appropriately shifted and the length adapted.
 */
 String trim_left(String str) {
-    int left = 0;
+    ptrdiff_t left = 0;
     for (; left < str.len && (str.s[left] == ' ' || str.s[left] == '\t' ); left++);
     // 0 <= left <= str.len
-    int len = str.len - left;
+    ptrdiff_t len = str.len - left;
     // 0 <= len <= str.len
     assert("not negative", len >= 0);
     assert("not larger", len <= str.len);
@@ -290,10 +335,10 @@ Removes spaces and tabs from the end of str. The underlying content is not
 modified, but the String is appropriately shifted and the length adapted.
 */
 String trim_right(String str) {
-    int right = str.len - 1;
+    ptrdiff_t right = str.len - 1;
     for (; right >= 0 && (str.s[right] == ' ' || str.s[right] == '\t' ); right--);
     // -1 <= right <= str.len - 1
-    int len = right + 1;
+    ptrdiff_t len = right + 1;
     // 0 <= right <= str.len
     assert("not negative", len >= 0);
     assert("not larger", len <= str.len);
@@ -344,7 +389,7 @@ bool ends_with(String str, String part) {
 /*
 Returns the index of part in str or -1 of part does not appear in s.
 */
-int index_of(String str, String part) {
+ptrdiff_t index_of(String str, String part) {
     if (str.len < part.len) return -1;
     // must use C strings to use strstr, on stack may overflow the stack
     char s[str.len + 1];
@@ -355,7 +400,7 @@ int index_of(String str, String part) {
     t[part.len] = '\0';
     char* p = strstr(s, t);
     if (p == NULL) return -1;
-    return (int)(p - s);
+    return p - s;
 }
 
 void index_of_test(void) {
@@ -368,15 +413,15 @@ void index_of_test(void) {
     test_equal_i(index_of(make_string(""), make_string("a")), -1);
 }
 
-int index_of_char(String str, char c) {
-    for (int i = 0; i < str.len; i++) {
+ptrdiff_t index_of_char(String str, char c) {
+    for (ptrdiff_t i = 0; i < str.len; i++) {
         if (str.s[i] == c) return i;
     }
     return -1;
 }
 
-int last_index_of_char(String str, char c) {
-    for (int i = str.len - 1; i >= 0; i--) {
+ptrdiff_t last_index_of_char(String str, char c) {
+    for (ptrdiff_t i = str.len - 1; i >= 0; i--) {
         if (str.s[i] == c) return i;
     }
     return -1;
@@ -429,6 +474,133 @@ String read_file(char* name) {
     return make_string2(s, sizeRead);
 }
 
+/*
+Reads the remaining contents of the file descriptor into a newly allocated
+buffer, followed by '\0'. Works for pipes and other files of unknown size.
+*/
+static String read_fd(int fd, char* name) {
+    String str = new_string(64 * 1024);
+    while (true) {
+        if (str.cap - str.len < 4096) xreserve(&str, str.cap);
+        ssize_t n = read(fd, str.s + str.len, str.cap - str.len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        panicf_if(n < 0, "Cannot read %s to end.\n", name);
+        if (n == 0) break;
+        str.len += n;
+    }
+    str.s[str.len] = '\0';
+    return str;
+}
+
+/*
+Loads the contents of a file. Regular files are mapped read-only into memory
+rather than copied, and the kernel is advised that they are read sequentially.
+The mapping is followed by a zero-filled page, so the contents always end with
+'\0', even if the file size is a multiple of the page size. Pipes and special
+files are read into an allocated buffer. The function fails if the file does
+not exist or cannot be read. The contents are released with release_file.
+*/
+FileData load_file(char* name) {
+    require_not_null(name);
+    FileData file;
+    panicf_if(!try_load_file(name, &file), "Cannot open %s", name);
+    return file;
+}
+
+/*
+Loads the contents of a file like load_file, but returns false instead of
+failing if the file does not exist or cannot be opened.
+*/
+bool try_load_file(char* name, FileData* result) {
+    require_not_null(name);
+    require_not_null(result);
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || S_ISDIR(st.st_mode)) {
+        close(fd);
+        return false;
+    }
+    FileData file = {{NULL, 0, 0}, 0};
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t size = st.st_size;
+        // reserve the file size rounded up to pages plus one zero page, then
+        // map the file over its beginning
+        size_t mapped = (size + page - 1) / page * page + page;
+        char* p = mmap(NULL, mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            char* q = mmap(p, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+            if (q != MAP_FAILED) {
+                madvise(q, size, MADV_SEQUENTIAL);
+                file = (FileData){make_string3(q, size, size), mapped};
+            } else {
+                munmap(p, mapped);
+            }
+        }
+    }
+    if (file.data.s == NULL) {
+        file.data = read_fd(fd, name);
+    }
+    close(fd);
+    *result = file;
+    return true;
+}
+
+/*
+Releases the contents of a file loaded with load_file.
+*/
+void release_file(FileData* file) {
+    require_not_null(file);
+    if (file->mapped > 0) {
+        munmap(file->data.s, file->mapped);
+    } else {
+        free(file->data.s);
+    }
+    *file = (FileData){{NULL, 0, 0}, 0};
+}
+
+void load_file_test(void) {
+    char name[] = "/tmp/load_file_testXXXXXX";
+    int fd = mkstemp(name);
+    panicf_if(fd < 0, "Cannot create %s", name);
+    // a page-sized file is followed by the zero page
+    size_t page = sysconf(_SC_PAGESIZE);
+    String str = new_string(page);
+    memset(str.s, 'x', page);
+    str.len = page;
+    write_file(name, str);
+    FileData file = load_file(name);
+    test_equal_i(file.mapped > 0, true);
+    test_equal_i(file.data.len, page);
+    test_equal_i(file.data.s[page - 1], 'x');
+    test_equal_i(file.data.s[page], '\0');
+    release_file(&file);
+    // a shorter file
+    str.len = 3;
+    write_file(name, str);
+    file = load_file(name);
+    test_equal_s(file.data, "xxx");
+    test_equal_i(file.data.s[3], '\0');
+    release_file(&file);
+    // an empty file is read
+    str.len = 0;
+    write_file(name, str);
+    file = load_file(name);
+    test_equal_i(file.mapped, 0);
+    test_equal_s(file.data, "");
+    test_equal_i(file.data.s[0], '\0');
+    release_file(&file);
+    // a character device is read
+    file = load_file("/dev/null");
+    test_equal_i(file.mapped, 0);
+    test_equal_i(file.data.len, 0);
+    release_file(&file);
+    free(str.s);
+    close(fd);
+    unlink(name);
+}
+
 void write_file(char* name, String data) {
     require_not_null(name);
 
@@ -440,6 +612,325 @@ void write_file(char* name, String data) {
     panicf_if(n_written != data.len, "Cannot write data to file %s.", name); 
 }
 
+/*
+Writes the text of the segments to the open file without copying it, using as
+few writev calls as possible. The name is used in error messages. The function
+fails if the file cannot be written.
+*/
+void write_segments_fd(int fd, char* name, Segments* segs) {
+    require_not_null(name);
+    require_not_null(segs);
+    struct iovec iov[IOV_MAX];
+    ptrdiff_t i = 0; // next segment to write
+    size_t done = 0; // bytes of segment i already written
+    while (i < segs->count) {
+        int n = 0;
+        for (ptrdiff_t k = i; k < segs->count && n < IOV_MAX; k++, n++) {
+            size_t skip = k == i ? done : 0;
+            iov[n].iov_base = segs->a[k].s + skip;
+            iov[n].iov_len = segs->a[k].len - skip;
+        }
+        ssize_t written = writev(fd, iov, n);
+        if (written < 0 && errno == EINTR) continue;
+        panicf_if(written < 0, "Cannot write data to file %s.", name);
+        // advance over the written bytes, the last segment may be partial
+        size_t w = written + done;
+        while (i < segs->count && w >= segs->a[i].len) {
+            w -= segs->a[i].len;
+            i++;
+        }
+        done = w;
+    }
+}
+
+/*
+Writes the text of the segments to the file without copying it. The function
+fails if the file cannot be written.
+*/
+void write_segments(char* name, Segments* segs) {
+    require_not_null(name);
+    require_not_null(segs);
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    panicf_if(fd < 0, "Cannot open %s", name);
+    write_segments_fd(fd, name, segs);
+    panicf_if(close(fd) != 0, "Cannot write data to file %s.", name);
+}
+
+/*
+Returns true if the open file is a regular file and contains exactly the text
+of the segments. The size is compared first, so that the contents are only
+mapped into memory if they may be equal.
+*/
+static bool fd_equals_segments(int fd, Segments* segs) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    if ((size_t)st.st_size != segs->len) return false;
+    if (segs->len == 0) return true;
+    char* p = mmap(NULL, segs->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) return false;
+    madvise(p, segs->len, MADV_SEQUENTIAL);
+    bool equal = segments_equal(segs, p);
+    munmap(p, segs->len);
+    return equal;
+}
+
+/*
+Returns true if the text of the segments equals the segs->len chars at s.
+*/
+bool segments_equal(Segments* segs, char* s) {
+    require_not_null(segs);
+    require_not_null(s);
+    for (ptrdiff_t i = 0; i < segs->count; i++) {
+        if (memcmp(s, segs->a[i].s, segs->a[i].len) != 0) return false;
+        s += segs->a[i].len;
+    }
+    return true;
+}
+
+/*
+Returns true if the file exists and contains exactly the text of the segments.
+*/
+bool file_equals_segments(char* name, Segments* segs) {
+    require_not_null(name);
+    require_not_null(segs);
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) return false;
+    bool equal = fd_equals_segments(fd, segs);
+    close(fd);
+    return equal;
+}
+
+/*
+Returns true if both files exist and have the same contents.
+*/
+bool files_equal(char* name1, char* name2) {
+    require_not_null(name1);
+    require_not_null(name2);
+    int fd = open(name2, O_RDONLY);
+    if (fd < 0) return false;
+    FileData file = load_file(name1);
+    Segments segs = new_segments(1);
+    xappend_segment_string(&segs, file.data);
+    bool equal = fd_equals_segments(fd, &segs);
+    free_segments(&segs);
+    release_file(&file);
+    close(fd);
+    return equal;
+}
+
+/*
+Creates a new file in the directory of the given file, so that it can later be
+renamed to the given file. If the given file exists, the new file gets its
+permissions. Stores the name of the new file in temp, which has to be freed by
+the caller. Returns the file descriptor, which is open for writing.
+*/
+int create_temp_file(char* name, String* temp) {
+    require_not_null(name);
+    require_not_null(temp);
+    *temp = new_string(strlen(name) + 32);
+    for (int i = 0; ; i++) {
+        temp->len = snprintf(temp->s, temp->cap, "%s.%ld.%d.tmp", name, (long)getpid(), i);
+        int fd = open(temp->s, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd >= 0) {
+            struct stat st;
+            if (stat(name, &st) == 0) fchmod(fd, st.st_mode & 07777);
+            return fd;
+        }
+        panicf_if(errno != EEXIST, "Cannot open %s", temp->s);
+    }
+}
+
+/*
+Closes the temporary file and renames it to the given file. Frees the name of
+the temporary file. Fails if the data cannot be written.
+*/
+static void finish_temp_file(int fd, String* temp, char* name) {
+    if (close(fd) != 0) {
+        unlink(temp->s);
+        panicf("Cannot write data to file %s.", temp->s);
+    }
+    if (rename(temp->s, name) != 0) {
+        unlink(temp->s);
+        panicf("Cannot rename %s to %s", temp->s, name);
+    }
+    free(temp->s);
+    *temp = (String){NULL, 0, 0};
+}
+
+/*
+Renames the temporary file to the given file, unless the given file already has
+the same contents. In this case the temporary file is removed and the given file
+stays untouched, including its modification time. Returns true if the given file
+was replaced.
+*/
+bool replace_if_changed(char* temp, char* name) {
+    require_not_null(temp);
+    require_not_null(name);
+    if (files_equal(temp, name)) {
+        unlink(temp);
+        return false;
+    }
+    if (rename(temp, name) != 0) {
+        unlink(temp);
+        panicf("Cannot rename %s to %s", temp, name);
+    }
+    return true;
+}
+
+/*
+Writes the text of the segments to the file, unless the file already has this
+content. Files with unchanged contents keep their modification time, so that
+build tools do not consider them to be out of date. A changed file is replaced
+atomically: The text is written to a temporary file, which is then renamed to
+the file. Readers thus see either the old or the new contents, never a partial
+file. Returns true if the file was written.
+*/
+bool write_segments_if_changed(char* name, Segments* segs) {
+    require_not_null(name);
+    require_not_null(segs);
+    if (file_equals_segments(name, segs)) return false;
+    String temp;
+    int fd = create_temp_file(name, &temp);
+    write_segments_fd(fd, temp.s, segs);
+    finish_temp_file(fd, &temp, name);
+    return true;
+}
+
+void write_segments_if_changed_test(void) {
+    char name[] = "/tmp/write_segments_if_changed_testXXXXXX";
+    int fd = mkstemp(name);
+    panicf_if(fd < 0, "Cannot create %s", name);
+    close(fd);
+    unlink(name);
+    Segments segs = new_segments(4);
+    xappend_segment_cstring(&segs, "abc");
+    xappend_segment_cstring(&segs, "def\n");
+    // a missing file is written
+    test_equal_i(file_equals_segments(name, &segs), false);
+    test_equal_i(write_segments_if_changed(name, &segs), true);
+    String str = read_file(name);
+    test_equal_s(str, "abcdef\n");
+    free(str.s);
+    struct stat st1, st2;
+    panicf_if(stat(name, &st1) != 0, "Cannot stat %s", name);
+    // an unchanged file is not touched
+    test_equal_i(file_equals_segments(name, &segs), true);
+    test_equal_i(write_segments_if_changed(name, &segs), false);
+    panicf_if(stat(name, &st2) != 0, "Cannot stat %s", name);
+    test_equal_i(st1.st_ino == st2.st_ino, true);
+    // a changed file of the same size is replaced
+    chmod(name, 0640);
+    segs.count = 0;
+    segs.len = 0;
+    xappend_segment_cstring(&segs, "abcxyz\n");
+    test_equal_i(write_segments_if_changed(name, &segs), true);
+    str = read_file(name);
+    test_equal_s(str, "abcxyz\n");
+    free(str.s);
+    panicf_if(stat(name, &st2) != 0, "Cannot stat %s", name);
+    test_equal_i(st2.st_mode & 07777, 0640);
+    // a temporary file replaces the file only if the contents differ
+    String temp;
+    fd = create_temp_file(name, &temp);
+    test_equal_i(write(fd, "abcxyz\n", 7), 7);
+    close(fd);
+    test_equal_i(files_equal(temp.s, name), true);
+    test_equal_i(replace_if_changed(temp.s, name), false);
+    test_equal_i(access(temp.s, F_OK), -1);
+    free(temp.s);
+    fd = create_temp_file(name, &temp);
+    close(fd);
+    test_equal_i(replace_if_changed(temp.s, name), true);
+    str = read_file(name);
+    test_equal_s(str, "");
+    free(str.s);
+    free(temp.s);
+    // an empty file equals empty segments
+    segs.count = 0;
+    segs.len = 0;
+    test_equal_i(file_equals_segments(name, &segs), true);
+    free_segments(&segs);
+    unlink(name);
+}
+
+/*
+Copies the file from to the file to, unless to already has the same contents,
+in which case it keeps its modification time. Where the file system supports
+it, the copy shares the data blocks of the original (a reflink) rather than
+duplicating them. The copy replaces to atomically. Returns false if from is not
+a regular file that can be read.
+*/
+bool copy_file_if_changed(char* from, char* to) {
+    require_not_null(from);
+    require_not_null(to);
+    int fd = open(from, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    char* p = "";
+    if (size > 0) {
+        p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+    }
+    Segments segs = new_segments(1);
+    xappend_segment(&segs, p, p + size);
+    if (!file_equals_segments(to, &segs)) {
+        String temp;
+        int out = create_temp_file(to, &temp);
+        bool cloned = false;
+#ifdef FICLONE
+        cloned = ioctl(out, FICLONE, fd) == 0;
+#endif
+        if (!cloned) write_segments_fd(out, temp.s, &segs);
+        finish_temp_file(out, &temp, to);
+    }
+    free_segments(&segs);
+    if (size > 0) munmap(p, size);
+    close(fd);
+    return true;
+}
+
+void copy_file_if_changed_test(void) {
+    char from[] = "/tmp/copy_file_if_changed_testXXXXXX";
+    int fd = mkstemp(from);
+    panicf_if(fd < 0, "Cannot create %s", from);
+    close(fd);
+    char to[64];
+    snprintf(to, sizeof(to), "%s.copy", from);
+    // an empty file is copied
+    test_equal_i(copy_file_if_changed(from, to), true);
+    String str = read_file(to);
+    test_equal_s(str, "");
+    free(str.s);
+    // a changed file is replaced
+    write_file(from, make_string("int a;\n"));
+    test_equal_i(copy_file_if_changed(from, to), true);
+    str = read_file(to);
+    test_equal_s(str, "int a;\n");
+    free(str.s);
+    test_equal_i(files_equal(from, to), true);
+    // an unchanged file is not touched
+    struct stat st1, st2;
+    panicf_if(stat(to, &st1) != 0, "Cannot stat %s", to);
+    test_equal_i(copy_file_if_changed(from, to), true);
+    panicf_if(stat(to, &st2) != 0, "Cannot stat %s", to);
+    test_equal_i(st1.st_ino == st2.st_ino, true);
+    // a missing file is not copied
+    unlink(from);
+    test_equal_i(copy_file_if_changed(from, to), false);
+    str = read_file(to);
+    test_equal_s(str, "int a;\n");
+    free(str.s);
+    unlink(to);
+}
+
 /*
 Splits the string using the given separator character. Does not modify the
 content of the argument string.
@@ -451,7 +942,7 @@ StringArray* split(char* s, char sep) {
     int line_count = 0;
     while (*t) {
         if (*t == sep) {
-            lines = new_string_node(make_string2(s, (int)(t - s)), lines);
+            lines = new_string_node(make_string2(s, t - s), lines);
             s = t + 1;
             line_count++;
         }
@@ -459,7 +950,7 @@ StringArray* split(char* s, char sep) {
     }
     // last line
     if (lines != NULL || (lines == NULL && t > s)) {
-        lines = new_string_node(make_string2(s, (int)(t - s)), lines);
+        lines = new_string_node(make_string2(s, t - s), lines);
         line_count++;
     }
     StringArray* arr = new_string_array(line_count);
@@ -520,7 +1011,7 @@ StringArray* split_lines(char* s) {
     while (*t) {
         char c = *t;
         if (c == '\n' || c == '\r') {
-            lines = new_string_node(make_string2(s, (int)(t - s)), lines);
+            lines = new_string_node(make_string2(s, t - s), lines);
             if (c == '\r') t++; // skip carriage return, if needed
             s = t + 1;
             line_count++;
@@ -529,7 +1020,7 @@ StringArray* split_lines(char* s) {
     }
     // last line
     if (lines != NULL || (lines == NULL && t > s)) {
-        lines = new_string_node(make_string2(s, (int)(t - s)), lines);
+        lines = new_string_node(make_string2(s, t - s), lines);
         line_count++;
     }
     StringArray* arr = new_string_array(line_count);
@@ -598,6 +1089,667 @@ void split_lines_test(void) {
     free(a);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Hashing
+
+#define HASH_C1 0x87c37b91114253d5ULL
+#define HASH_C2 0x4cf5ad432745937fULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// Loads 8 bytes as a little endian word, whatever the byte order of the machine.
+static uint64_t load_le64(const unsigned char* p) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t k;
+    memcpy(&k, p, 8);
+    return k;
+#else
+    uint64_t k = 0;
+    for (int i = 7; i >= 0; i--) k = (k << 8) | p[i];
+    return k;
+#endif
+}
+
+// Hashes n blocks of 16 bytes.
+static void hash_blocks(Hasher* h, const unsigned char* p, size_t n) {
+    uint64_t h1 = h->h1, h2 = h->h2;
+    for (; n > 0; n--, p += 16) {
+        uint64_t k1 = load_le64(p);
+        uint64_t k2 = load_le64(p + 8);
+        k1 *= HASH_C1; k1 = rotl64(k1, 31); k1 *= HASH_C2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= HASH_C2; k2 = rotl64(k2, 33); k2 *= HASH_C1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+    h->h1 = h1;
+    h->h2 = h2;
+}
+
+/*
+Starts an incremental hash (MurmurHash3, x64 variant, 128 bits). The data may
+be passed to hasher_update in pieces of any size. The data is read as little
+endian words, so the hash is the same on all machines, e.g., for fingerprints
+that are checked elsewhere. It is not cryptographic.
+*/
+void hasher_init(Hasher* h, uint64_t seed) {
+    require_not_null(h);
+    *h = (Hasher){seed, seed, {0}, 0, 0};
+}
+
+void hasher_update(Hasher* h, const void* data, size_t len) {
+    require_not_null(h);
+    require("valid data", data != NULL || len == 0);
+    const unsigned char* p = data;
+    h->len += len;
+    if (h->tail_len > 0) {
+        size_t n = 16 - h->tail_len;
+        if (n > len) n = len;
+        memcpy(h->tail + h->tail_len, p, n);
+        h->tail_len += n;
+        p += n;
+        len -= n;
+        if (h->tail_len < 16) return;
+        hash_blocks(h, h->tail, 1);
+        h->tail_len = 0;
+    }
+    hash_blocks(h, p, len / 16);
+    p += len / 16 * 16;
+    len %= 16;
+    memcpy(h->tail, p, len);
+    h->tail_len = len;
+}
+
+void hasher_final(Hasher* h, uint64_t hash[2]) {
+    require_not_null(h);
+    require_not_null(hash);
+    uint64_t h1 = h->h1, h2 = h->h2;
+    size_t n = h->tail_len;
+    if (n > 0) {
+        // the tail bytes, little endian
+        const unsigned char* p = h->tail;
+        uint64_t k1 = 0, k2 = 0;
+        for (size_t i = n; i > 8; i--) k2 = (k2 << 8) | p[i - 1];
+        for (size_t i = n < 8 ? n : 8; i > 0; i--) k1 = (k1 << 8) | p[i - 1];
+        if (n > 8) {
+            k2 *= HASH_C2; k2 = rotl64(k2, 33); k2 *= HASH_C1; h2 ^= k2;
+        }
+        k1 *= HASH_C1; k1 = rotl64(k1, 31); k1 *= HASH_C2; h1 ^= k1;
+    }
+    h1 ^= h->len;
+    h2 ^= h->len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    hash[0] = h1;
+    hash[1] = h2;
+}
+
+/*
+Computes a 128-bit hash of the data in one piece. The data is processed in
+blocks of 16 bytes, which makes hashing much faster than reading the data.
+*/
+void hash128(const void* data, size_t len, uint64_t seed, uint64_t hash[2]) {
+    require_not_null(data);
+    require_not_null(hash);
+    Hasher h;
+    hasher_init(&h, seed);
+    hasher_update(&h, data, len);
+    hasher_final(&h, hash);
+}
+
+void hash128_test(void) {
+    uint64_t h[2], g[2];
+    hash128("", 0, 0, h);
+    test_equal_i(h[0] == 0 && h[1] == 0, true);
+    hash128("The quick brown fox jumps over the lazy dog", 43, 0, h);
+    test_equal_i(h[0] == 0xe34bbc7bbc071b6cULL && h[1] == 0x7a433ca9c49a9347ULL, true);
+    // every length of the tail, every bit of the data, and the seed matter
+    char s[] = "The quick brown fox jumps over the lazy dog";
+    size_t n = strlen(s);
+    for (size_t len = 1; len <= n; len++) {
+        hash128(s, len, 0, h);
+        hash128(s, len - 1, 0, g);
+        test_equal_i(h[0] == g[0] && h[1] == g[1], false);
+        for (int bit = 0; bit < 8; bit++) {
+            s[len - 1] ^= 1 << bit;
+            hash128(s, len, 0, g);
+            s[len - 1] ^= 1 << bit;
+            test_equal_i(h[0] == g[0] || h[1] == g[1], false);
+        }
+        hash128(s, len, 1, g);
+        test_equal_i(h[0] == g[0] || h[1] == g[1], false);
+        // pieces of any size give the same hash
+        for (size_t piece = 1; piece <= len; piece++) {
+            Hasher hasher;
+            hasher_init(&hasher, 0);
+            for (size_t i = 0; i < len; i += piece) {
+                hasher_update(&hasher, s + i, len - i < piece ? len - i : piece);
+            }
+            hasher_final(&hasher, g);
+            test_equal_i(h[0] == g[0] && h[1] == g[1], true);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Asynchronous I/O
+
+#ifdef HAVE_IO_URING
+/*
+Returns true if the io_uring instance supports the reads and vectored writes
+that the ring submits. Kernels before 5.6 set up an io_uring, but complete
+IORING_OP_READ with -EINVAL, and they do not support probing either.
+*/
+static bool io_uring_supports_ops(int fd) {
+    size_t n = 256;
+    struct io_uring_probe* probe = xcalloc(1, sizeof(struct io_uring_probe) 
+            + n * sizeof(struct io_uring_probe_op));
+    bool supported = false;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, n) >= 0) {
+        int ops[] = {IORING_OP_READ, IORING_OP_WRITEV};
+        supported = true;
+        for (int i = 0; i < 2; i++) {
+            supported = supported && ops[i] <= probe->last_op && ops[i] < probe->ops_len
+                && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) != 0;
+        }
+    }
+    free(probe);
+    return supported;
+}
+#endif
+
+/*
+Creates a ring for up to capacity requests in flight. Uses io_uring if it is
+available, unless synchronous is set. Otherwise (for instance if the kernel is
+too old or a sandbox forbids io_uring), the requests are performed
+synchronously.
+*/
+void io_ring_init(IoRing* ring, unsigned capacity, bool synchronous) {
+    require_not_null(ring);
+    require("positive", capacity > 0);
+    memset(ring, 0, sizeof(IoRing));
+    ring->fd = -1;
+    ring->capacity = capacity;
+#ifdef HAVE_IO_URING
+    if (synchronous) {
+        ring->completed = xcalloc(capacity, sizeof(IoCompletion));
+        return;
+    }
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, capacity, &p);
+    if (fd >= 0 && !io_uring_supports_ops(fd)) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd >= 0) {
+        ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        char* sq = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, 
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        char* cq = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, 
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        void* sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, 
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sq != MAP_FAILED && cq != MAP_FAILED && sqes != MAP_FAILED) {
+            ring->fd = fd;
+            ring->sq_ring = sq;
+            ring->cq_ring = cq;
+            ring->sqes = sqes;
+            ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+            ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+            ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+            ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+            ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+            ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+            ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+            ring->cqes = cq + p.cq_off.cqes;
+            // the kernel may round up the number of entries
+            if (ring->capacity > p.sq_entries) ring->capacity = p.sq_entries;
+            return;
+        }
+        if (sq != MAP_FAILED) munmap(sq, ring->sq_ring_size);
+        if (cq != MAP_FAILED) munmap(cq, ring->cq_ring_size);
+        if (sqes != MAP_FAILED) munmap(sqes, ring->sqes_size);
+        close(fd);
+    }
+#endif
+    ring->completed = xcalloc(capacity, sizeof(IoCompletion));
+}
+
+void io_ring_free(IoRing* ring) {
+    require_not_null(ring);
+    require("no requests in flight", ring->inflight == 0);
+    if (ring->fd >= 0) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        munmap(ring->cq_ring, ring->cq_ring_size);
+        munmap(ring->sqes, ring->sqes_size);
+        close(ring->fd);
+    }
+    free(ring->completed);
+    memset(ring, 0, sizeof(IoRing));
+    ring->fd = -1;
+}
+
+/*
+Returns true if no more requests can be made until completions are collected
+with io_wait.
+*/
+bool io_ring_full(IoRing* ring) {
+    require_not_null(ring);
+    return ring->inflight >= ring->capacity;
+}
+
+#ifdef HAVE_IO_URING
+/*
+Returns a cleared submission queue entry for a new request. The request is
+passed to the kernel with the next io_wait.
+*/
+static struct io_uring_sqe* io_next_sqe(IoRing* ring, uint64_t tag) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*)ring->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = tag;
+    ring->sq_array[index] = index;
+    return sqe;
+}
+
+static void io_push_sqe(IoRing* ring) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    ring->inflight++;
+}
+#endif
+
+/*
+Reads up to len bytes at the offset of the file into buf. The buffer must stay
+valid until the completion has been reported.
+*/
+void io_read(IoRing* ring, int fd, void* buf, size_t len, int64_t offset, uint64_t tag) {
+    require_not_null(ring);
+    require("not full", !io_ring_full(ring));
+#ifdef HAVE_IO_URING
+    if (ring->fd >= 0) {
+        struct io_uring_sqe* sqe = io_next_sqe(ring, tag);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t)buf;
+        sqe->len = len > UINT32_MAX ? UINT32_MAX : len;
+        sqe->off = offset;
+        io_push_sqe(ring);
+        return;
+    }
+#endif
+    ssize_t n;
+    do {
+        n = pread(fd, buf, len, offset);
+    } while (n < 0 && errno == EINTR);
+    ring->completed[ring->inflight++] = (IoCompletion){tag, n < 0 ? -errno : n};
+}
+
+/*
+Writes the buffers of iov at the offset of the file. The buffers and iov must
+stay valid until the completion has been reported.
+*/
+void io_writev(IoRing* ring, int fd, struct iovec* iov, int count, int64_t offset, uint64_t tag) {
+    require_not_null(ring);
+    require_not_null(iov);
+    require("not full", !io_ring_full(ring));
+#ifdef HAVE_IO_URING
+    if (ring->fd >= 0) {
+        struct io_uring_sqe* sqe = io_next_sqe(ring, tag);
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t)iov;
+        sqe->len = count;
+        sqe->off = offset;
+        io_push_sqe(ring);
+        return;
+    }
+#endif
+    ssize_t n;
+    do {
+        n = pwritev(fd, iov, count, offset);
+    } while (n < 0 && errno == EINTR);
+    ring->completed[ring->inflight++] = (IoCompletion){tag, n < 0 ? -errno : n};
+}
+
+/*
+Passes the requests made since the last call to the kernel, waits until at
+least one of the requests in flight has completed, and stores up to max
+completions. Returns the number of completions stored, 0 if no requests are
+in flight.
+*/
+int io_wait(IoRing* ring, IoCompletion* completions, int max) {
+    require_not_null(ring);
+    require_not_null(completions);
+    require("positive", max > 0);
+    if (ring->inflight == 0) return 0;
+#ifdef HAVE_IO_URING
+    if (ring->fd >= 0) {
+        unsigned head = *ring->cq_head;
+        while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) || ring->queued > 0) {
+            int r = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1, 
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+            if (r < 0 && errno == EINTR) continue;
+            panicf_if(r < 0, "io_uring_enter failed (%d)", errno);
+            ring->queued -= r;
+        }
+        int n = 0;
+        while (n < max && head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = (struct io_uring_cqe*)ring->cqes + (head & *ring->cq_mask);
+            completions[n++] = (IoCompletion){cqe->user_data, cqe->res};
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        ring->inflight -= n;
+        return n;
+    }
+#endif
+    int n = (int)ring->inflight < max ? (int)ring->inflight : max;
+    memcpy(completions, ring->completed, n * sizeof(IoCompletion));
+    memmove(ring->completed, ring->completed + n, (ring->inflight - n) * sizeof(IoCompletion));
+    ring->inflight -= n;
+    return n;
+}
+
+/*
+Writes a file in several requests and reads it back, with io_uring (if
+available) and synchronously.
+*/
+void io_ring_test(void) {
+    char name[] = "/tmp/io_ring_testXXXXXX";
+    for (int synchronous = 0; synchronous <= 1; synchronous++) {
+        int fd = mkstemp(name);
+        panicf_if(fd < 0, "Cannot create %s", name);
+        IoRing ring;
+        io_ring_init(&ring, 4, synchronous);
+        test_equal_i(io_ring_full(&ring), false);
+        IoCompletion done[8];
+        test_equal_i(io_wait(&ring, done, 8), 0);
+        char* parts[] = {"abc", "defg", "h", "ijklmn"};
+        struct iovec iov[4];
+        int64_t offset = 0;
+        for (int i = 0; i < 4; i++) {
+            iov[i] = (struct iovec){parts[i], strlen(parts[i])};
+            io_writev(&ring, fd, iov + i, 1, offset, 10 + i);
+            offset += iov[i].iov_len;
+        }
+        test_equal_i(io_ring_full(&ring), true);
+        int64_t total = 0;
+        int count = 0;
+        uint64_t tags = 0;
+        while (count < 4) {
+            int n = io_wait(&ring, done, 8);
+            for (int i = 0; i < n; i++) {
+                total += done[i].result;
+                tags += done[i].tag;
+            }
+            count += n;
+        }
+        test_equal_i(total, 14);
+        test_equal_i(tags, 10 + 11 + 12 + 13);
+        char buf[32] = {0};
+        io_read(&ring, fd, buf, sizeof(buf), 2, 7);
+        test_equal_i(io_wait(&ring, done, 8), 1);
+        test_equal_i(done[0].tag, 7);
+        test_equal_i(done[0].result, 12);
+        test_equal_s(make_string(buf), "cdefghijklmn");
+        // errors are reported as negative error numbers
+        io_read(&ring, -1, buf, sizeof(buf), 0, 8);
+        test_equal_i(io_wait(&ring, done, 8), 1);
+        test_equal_i(done[0].result, -EBADF);
+        io_ring_free(&ring);
+        close(fd);
+        unlink(name);
+        strcpy(name, "/tmp/io_ring_testXXXXXX");
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Arena
+
+/*
+Creates an empty arena. Blocks are allocated on demand and have at least the
+given size.
+*/
+Arena make_arena(size_t block_size) {
+    require("positive block size", block_size > 0);
+    return (Arena){NULL, NULL, block_size};
+}
+
+/*
+Returns a new block that can hold at least size bytes.
+*/
+static ArenaBlock* new_arena_block(size_t size) {
+    ArenaBlock* block = xmalloc(sizeof(ArenaBlock) + ARENA_ALIGN + size);
+    block->next = NULL;
+    block->start = -(uintptr_t)block->data & (ARENA_ALIGN - 1);
+    block->cap = block->start + size;
+    block->used = block->start;
+    return block;
+}
+
+/*
+Allocates size bytes from the arena. The memory is suitably aligned for any
+type, is not initialized, and stays valid until the arena is reset or freed.
+*/
+void* arena_alloc(Arena* arena, size_t size) {
+    require_not_null(arena);
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaBlock* block = arena->current;
+    // use the first following block that is large enough (blocks are kept
+    // across resets)
+    while (block != NULL && block->used + size > block->cap) {
+        block = block->next;
+        if (block != NULL) block->used = block->start;
+    }
+    if (block == NULL) {
+        size_t cap = size > arena->block_size ? size : arena->block_size;
+        block = new_arena_block(cap);
+        if (arena->current == NULL) {
+            arena->first = block;
+        } else {
+            block->next = arena->current->next;
+            arena->current->next = block;
+        }
+    }
+    arena->current = block;
+    void* p = block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+/*
+Releases all memory allocated from the arena at once. The blocks are kept so
+that they can be reused for subsequent allocations.
+*/
+void arena_reset(Arena* arena) {
+    require_not_null(arena);
+    arena->current = arena->first;
+    if (arena->current != NULL) arena->current->used = arena->current->start;
+}
+
+/*
+Frees all blocks of the arena.
+*/
+void arena_free(Arena* arena) {
+    require_not_null(arena);
+    ArenaBlock* next;
+    for (ArenaBlock* block = arena->first; block != NULL; block = next) {
+        next = block->next;
+        free(block);
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+}
+
+void arena_test(void) {
+    Arena arena = make_arena(64);
+    char* a = arena_alloc(&arena, 10);
+    char* b = arena_alloc(&arena, 10);
+    test_equal_i(b - a, ARENA_ALIGN);
+    char* c = arena_alloc(&arena, 1000); // larger than a block
+    test_equal_i(arena.first->next != NULL, true);
+    memset(c, 'x', 1000);
+    arena_reset(&arena);
+    char* d = arena_alloc(&arena, 10);
+    test_equal_i(d == a, true); // first block is reused
+    char* e = arena_alloc(&arena, 1000);
+    test_equal_i(e == c, true); // large block is reused
+    arena_free(&arena);
+    test_equal_i(arena.first == NULL, true);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Segments
+
+#define NEWLINES_16 "\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n"
+static char Newlines[] = NEWLINES_16 NEWLINES_16 NEWLINES_16 NEWLINES_16 
+    NEWLINES_16 NEWLINES_16 NEWLINES_16 NEWLINES_16;
+
+/*
+Creates an empty list of segments with room for cap segments.
+*/
+Segments new_segments(ptrdiff_t cap) {
+    require("positive capacity", cap > 0);
+    return (Segments){0, cap, 0, xmalloc(cap * sizeof(Segment))};
+}
+
+/*
+Frees the list, but not the memory that the segments refer to.
+*/
+void free_segments(Segments* segs) {
+    require_not_null(segs);
+    free(segs->a);
+    *segs = (Segments){0, 0, 0, NULL};
+}
+
+/*
+Appends the chars from s (inclusive) to t (exclusive) as a segment. Extends a
+preceding segment that ends at s, so that consecutive slices of the same text
+form a single segment.
+*/
+void xappend_segment(Segments* segs, char* s, char* t) {
+    require_not_null(segs);
+    require_not_null(s);
+    require_not_null(t);
+    require("t not before s", s <= t);
+    if (s == t) return;
+    segs->len += t - s;
+    if (segs->count > 0) {
+        Segment* last = &segs->a[segs->count - 1];
+        if (last->s + last->len == s) {
+            last->len += t - s;
+            return;
+        }
+    }
+    if (segs->count >= segs->cap) {
+        segs->cap = segs->cap < 16 ? 16 : 2 * segs->cap;
+        segs->a = xrealloc(segs->a, segs->cap * sizeof(Segment));
+    }
+    segs->a[segs->count++] = (Segment){s, t - s};
+}
+
+/*
+Appends str as a segment.
+*/
+void xappend_segment_string(Segments* segs, String str) {
+    xappend_segment(segs, str.s, str.s + str.len);
+}
+
+/*
+Appends t, typically a string literal, as a segment.
+*/
+void xappend_segment_cstring(Segments* segs, char* t) {
+    require_not_null(t);
+    xappend_segment(segs, t, t + strlen(t));
+}
+
+/*
+Appends n line breaks, which refer to a static buffer of line breaks.
+*/
+void xappend_segment_newlines(Segments* segs, ptrdiff_t n) {
+    require("not negative", n >= 0);
+    ptrdiff_t m = sizeof(Newlines) - 1;
+    for (; n > m; n -= m) {
+        xappend_segment(segs, Newlines, Newlines + m);
+    }
+    xappend_segment(segs, Newlines, Newlines + n);
+}
+
+/*
+Appends the segments of other.
+*/
+void xappend_segments(Segments* segs, Segments* other) {
+    require_not_null(other);
+    for (ptrdiff_t i = 0; i < other->count; i++) {
+        Segment* seg = &other->a[i];
+        xappend_segment(segs, seg->s, seg->s + seg->len);
+    }
+}
+
+/*
+Returns a newly allocated copy of the text of the segments.
+*/
+String segments_to_string(Segments* segs) {
+    require_not_null(segs);
+    String str = new_string(segs->len + 1);
+    for (ptrdiff_t i = 0; i < segs->count; i++) {
+        memcpy(str.s + str.len, segs->a[i].s, segs->a[i].len);
+        str.len += segs->a[i].len;
+    }
+    str.s[str.len] = '\0';
+    return str;
+}
+
+void segments_test(void) {
+    char* text = "abcdef";
+    Segments segs = new_segments(1);
+    xappend_segment(&segs, text, text + 2);
+    xappend_segment(&segs, text + 2, text + 3);
+    test_equal_i(segs.count, 1); // contiguous slices are merged
+    xappend_segment(&segs, text, text);
+    test_equal_i(segs.count, 1);
+    xappend_segment_cstring(&segs, "xy");
+    xappend_segment(&segs, text + 4, text + 6);
+    xappend_segment_newlines(&segs, 3);
+    test_equal_i(segs.count, 4);
+    test_equal_i(segs.len, 10);
+    String str = segments_to_string(&segs);
+    test_equal_s(str, "abcxyef\n\n\n");
+    free(str.s);
+
+    Segments other = new_segments(4);
+    xappend_segment_newlines(&other, 300);
+    test_equal_i(other.len, 300);
+    xappend_segments(&segs, &other);
+    test_equal_i(segs.len, 310);
+    str = segments_to_string(&segs);
+    test_equal_i(str.len, 310);
+    test_equal_i(str.s[9] == '\n' && str.s[309] == '\n', true);
+    free(str.s);
+    free_segments(&other);
+    free_segments(&segs);
+    test_equal_i(segs.a == NULL, true);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Testing
 
@@ -664,7 +1816,7 @@ bool base_test_equal_s(const char *file, int line, String a, char* e) {
         base_check_success_count++;
         return true;
     } else {
-        printf("%s, line %d: Actual value \"%.*s\" differs from expected value \"%s\".\n", file, line, a.len, a.s, e);
+        printf("%s, line %d: Actual value \"%.*s\" differs from expected value \"%s\".\n", file, line, (int)a.len, a.s, e);
         return false;
     }
 }
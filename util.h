@@ -9,7 +9,15 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 /*
 A String points to some part of a C string, i.e., it does not have to end with
@@ -18,14 +26,14 @@ A String points to some part of a C string, i.e., it does not have to end with
 typedef struct String String;
 struct String {
     char* s;
-    int len;
-    int cap;
+    ptrdiff_t len;
+    ptrdiff_t cap;
 };
 
 String make_string(char* s);
-String make_string2(char* s, int len);
-String make_string3(char* s, int len, int cap);
-String new_string(int cap);
+String make_string2(char* s, ptrdiff_t len);
+String make_string3(char* s, ptrdiff_t len, ptrdiff_t cap);
+String new_string(ptrdiff_t cap);
 
 void append_string(String* str, String t);
 void append_cstring(String* str, char* t);
@@ -37,6 +45,8 @@ void xappend_string(String* str, String t);
 void xappend_cstring(String* str, char* t);
 void xappend_cstring2(String* str, char* s, char* t);
 void xappend_char(String* str, char c);
+void xappend_chars(String* str, char c, ptrdiff_t n);
+void xreserve(String* str, ptrdiff_t n);
 void xappend_test(void);
 
 void print_string(String str);
@@ -51,10 +61,10 @@ void trim_right_test(void);
 bool contains(String str, String part);
 bool starts_with(String str, String part);
 bool ends_with(String str, String part);
-int index_of(String str, String part);
+ptrdiff_t index_of(String str, String part);
 void index_of_test(void);
-int index_of_char(String str, char c);
-int last_index_of_char(String str, char c);
+ptrdiff_t index_of_char(String str, char c);
+ptrdiff_t last_index_of_char(String str, char c);
 
 bool cstring_equal(String str, char* t);
 
@@ -106,8 +116,159 @@ void split_test(void);
 StringArray* split_lines(char* s);
 void split_lines_test(void);
 
+/*
+An Arena is a bump allocator. Memory is handed out from large blocks and is
+only released in bulk, either by resetting the arena (which keeps the blocks
+for reuse) or by freeing it.
+*/
+// alignment of all arena allocations, suitable for any basic type
+#define ARENA_ALIGN 16
+
+typedef struct ArenaBlock ArenaBlock;
+struct ArenaBlock {
+    ArenaBlock* next;
+    size_t start; // offset of the first aligned byte in data
+    size_t cap;
+    size_t used;
+    char data[]; // variable-sized array
+};
+
+typedef struct Arena Arena;
+struct Arena {
+    ArenaBlock* first;
+    ArenaBlock* current;
+    size_t block_size;
+};
+
+Arena make_arena(size_t block_size);
+void* arena_alloc(Arena* arena, size_t size);
+void arena_reset(Arena* arena);
+void arena_free(Arena* arena);
+void arena_test(void);
+
+/*
+Segments describe a text as a sequence of slices of existing memory, e.g., of
+a source text and of string literals. The slices are not copied, so the memory
+they refer to has to stay valid while the segments are in use.
+*/
+typedef struct Segment Segment;
+struct Segment {
+    char* s;
+    size_t len;
+};
+
+typedef struct Segments Segments;
+struct Segments {
+    ptrdiff_t count;
+    ptrdiff_t cap;
+    size_t len; // total length of the text
+    Segment* a;
+};
+
+Segments new_segments(ptrdiff_t cap);
+void free_segments(Segments* segs);
+void xappend_segment(Segments* segs, char* s, char* t);
+void xappend_segment_string(Segments* segs, String str);
+void xappend_segment_cstring(Segments* segs, char* t);
+void xappend_segment_newlines(Segments* segs, ptrdiff_t n);
+void xappend_segments(Segments* segs, Segments* other);
+String segments_to_string(Segments* segs);
+void segments_test(void);
+
+/*
+The contents of a file, followed by '\0'. Regular files are mapped into memory,
+other files are read into an allocated buffer.
+*/
+typedef struct FileData FileData;
+struct FileData {
+    String data;
+    size_t mapped; // size of the mapping, 0 if the contents were read
+};
+
 String read_file(char* name);
+FileData load_file(char* name);
+bool try_load_file(char* name, FileData* result);
+void release_file(FileData* file);
+void load_file_test(void);
 void write_file(char* name, String data);
+void write_segments_fd(int fd, char* name, Segments* segs);
+void write_segments(char* name, Segments* segs);
+bool file_equals_segments(char* name, Segments* segs);
+bool files_equal(char* name1, char* name2);
+int create_temp_file(char* name, String* temp);
+bool replace_if_changed(char* temp, char* name);
+bool write_segments_if_changed(char* name, Segments* segs);
+void write_segments_if_changed_test(void);
+bool copy_file_if_changed(char* from, char* to);
+void copy_file_if_changed_test(void);
+bool segments_equal(Segments* segs, char* s);
+
+/*
+The state of an incremental 128-bit hash.
+*/
+typedef struct Hasher Hasher;
+struct Hasher {
+    uint64_t h1;
+    uint64_t h2;
+    unsigned char tail[16]; // bytes not hashed yet
+    size_t tail_len;
+    size_t len; // total number of bytes
+};
+
+void hasher_init(Hasher* h, uint64_t seed);
+void hasher_update(Hasher* h, const void* data, size_t len);
+void hasher_final(Hasher* h, uint64_t hash[2]);
+void hash128(const void* data, size_t len, uint64_t seed, uint64_t hash[2]);
+void hash128_test(void);
+
+/*
+The result of an asynchronous read or write: the number of bytes transferred,
+or a negative error number.
+*/
+typedef struct IoCompletion IoCompletion;
+struct IoCompletion {
+    uint64_t tag; // identifies the request
+    int64_t result;
+};
+
+/*
+A queue of asynchronous file reads and writes. On Linux, the requests are
+passed to the kernel in batches through an io_uring instance. If io_uring is
+not available, the requests are performed synchronously with pread and
+pwritev when they are made, and their completions are reported by io_wait as
+well. Requests can be made as long as the ring is not full.
+*/
+typedef struct IoRing IoRing;
+struct IoRing {
+    int fd; // io_uring instance, -1 if the requests are performed synchronously
+    unsigned capacity; // maximum number of requests in flight
+    unsigned queued; // requests not yet passed to the kernel
+    unsigned inflight; // requests not yet reported by io_wait
+    // submission queue and completion queue shared with the kernel
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    void* sqes;
+    void* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    IoCompletion* completed; // results of synchronous requests
+};
+
+void io_ring_init(IoRing* ring, unsigned capacity, bool synchronous);
+void io_ring_free(IoRing* ring);
+bool io_ring_full(IoRing* ring);
+void io_read(IoRing* ring, int fd, void* buf, size_t len, int64_t offset, uint64_t tag);
+void io_writev(IoRing* ring, int fd, struct iovec* iov, int count, int64_t offset, uint64_t tag);
+int io_wait(IoRing* ring, IoCompletion* completions, int max);
+void io_ring_test(void);
 
 
 
@@ -368,6 +529,14 @@ if (condition) {\
    result;\
 })
 
+#define xrealloc(pointer, size) ({\
+   void* result = realloc(pointer, size);\
+    if (result == NULL) {\
+        panic("Cannot allocate memory.");\
+    }\
+   result;\
+})
+
 
 
 /** 